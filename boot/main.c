@@ -23,10 +23,13 @@
  *  * Assuming this boot loader is stored in the first sector of the
  *    hard-drive, this code takes over...
  *
- *  * control starts in bootloader.S -- which sets up protected mode,
+ *  * control starts in bootloader.S -- which collects the BIOS memory
+ *    map (see inc/e820.h), sets up protected mode,
  *    and a stack so C code then run, then calls bootmain()
  *
  *  * bootmain() in this file takes over, reads in the kernel and jumps to it.
+ *    The memory map is left at E820_MAP, which the kernel image and the
+ *    ELF header scratch space do not overlap.
  **********************************************************************/
 
 #define SECTSIZE	512
@@ -321,10 +321,17 @@ serve(void)
 void
 umain(void)
 {
+	int r;
+
 	static_assert(sizeof(struct File) == 256);
         binaryname = "fs";
 	cprintf("FS is running\n");
 
+	// Every file operation waits for us, so don't let the scheduler
+	// demote us behind the environments doing the waiting.
+	if ((r = sys_env_set_priority(0, 0)) < 0)
+		panic("sys_env_set_priority: %e", r);
+
 	// Check that we are able to do I/O
 	outw(0x8A00, 0x8A00);
 	cprintf("FS can do I/O\n");
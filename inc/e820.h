@@ -0,0 +1,33 @@
+#ifndef JOS_INC_E820_H
+#define JOS_INC_E820_H
+
+// Physical memory map reported by the BIOS (INT 15h, AX=E820h).
+// The boot loader collects it in real mode and leaves it at physical
+// address E820_MAP for the kernel: a 32-bit entry count followed by
+// the entries themselves.
+
+#define E820_MAP	0x7000		// below the boot loader's stack
+#define E820_MAX	32		// entries the boot loader stores at most
+#define E820_ENTSZ	20		// size of one entry as returned by the BIOS
+#define E820_SMAP	0x534d4150	// "SMAP"
+
+// Entry types
+#define E820_RAM	1		// usable memory
+#define E820_RESERVED	2
+
+#ifndef __ASSEMBLER__
+#include <inc/types.h>
+
+struct E820_entry {
+	uint64_t addr;			// start of the range
+	uint64_t len;			// length in bytes
+	uint32_t type;			// E820_*
+} __attribute__((packed));
+
+struct E820_map {
+	uint32_t nr;
+	struct E820_entry map[E820_MAX];
+} __attribute__((packed));
+#endif /* !__ASSEMBLER__ */
+
+#endif /* !JOS_INC_E820_H */
@@ -35,6 +35,17 @@ typedef int32_t envid_t;
 #define ENV_RUNNABLE		1
 #define ENV_NOT_RUNNABLE	2
 
+// Scheduling priorities, 0 is the highest (see kern/sched.c)
+#define ENV_NPRIO		4
+#define ENV_PRIO_AUTO		(-1)	// sys_env_set_priority: unpin
+
+// CPU time used by an environment, as returned by sys_env_cputime()
+struct Env_cputime {
+	uint64_t ct_user;		// TSC cycles spent in user mode
+	uint64_t ct_kern;		// TSC cycles the kernel spent on it
+	uint32_t ct_runs;		// times it was given the CPU
+};
+
 struct Env {
 	struct Trapframe env_tf;	// Saved registers
 	LIST_ENTRY(Env) env_link;	// Free list link pointers
@@ -42,10 +53,23 @@ struct Env {
 	envid_t env_parent_id;		// env_id of this env's parent
 	unsigned env_status;		// Status of the environment
 	uint32_t env_runs;		// Number of times environment has run
+	uint64_t env_user_cycles;	// TSC cycles spent in user mode
+	uint64_t env_kern_cycles;	// TSC cycles the kernel spent on it
+	TAILQ_ENTRY(Env) env_runq_link;	// run queue link, while runnable
+	int env_prio;			// run queue the env waits on
+	bool env_prio_pinned;		// env_prio set by sys_env_set_priority
+	uint32_t env_slice_used;	// clock ticks used at this env_prio
+	uint16_t env_wait_irqs;		// IRQ lines it sleeps on, if any
+	int env_cpunum;			// CPU whose run queue it waits on
+	bool env_running;		// curenv of CPU env_cpunum
+	bool env_dying;			// destroy it when it enters the kernel
 
 	// Address space
 	pde_t *env_pgdir;		// Kernel virtual address of page dir
 	physaddr_t env_cr3;		// Physical address of page dir
+	struct Vma *env_vmas;		// address space layout (kern/vma.h)
+	int env_nvmas;			// number of areas in env_vmas
+	int env_vmas_order;		// env_vmas spans (PGSIZE << this)
 
 	// Exception handling
 	void *env_pgfault_upcall;	// page fault upcall entry point
@@ -40,16 +40,26 @@ char*	readline(const char *buf);
 void	sys_cputs(const char *string, size_t len);
 int	sys_cgetc(void);
 envid_t	sys_getenvid(void);
+int	sys_env_cputime(struct Env_cputime *ct);
 int	sys_env_destroy(envid_t);
 void	sys_yield(void);
 static envid_t sys_exofork(void);
 int	sys_env_set_status(envid_t env, int status);
+int	sys_env_set_priority(envid_t env, int prio);
 int	sys_env_set_trapframe(envid_t env, struct Trapframe *tf);
 int	sys_env_set_pgfault_upcall(envid_t env, void *upcall);
 int	sys_page_alloc(envid_t env, void *pg, int perm);
+int	sys_page_alloc_zeroed(envid_t env, void *pg, int perm);
+int	sys_page_alloc_large(envid_t env, void *pg, int perm);
 int	sys_page_map(envid_t src_env, void *src_pg,
 		     envid_t dst_env, void *dst_pg, int perm);
+int	sys_page_map_batch(envid_t src_env, envid_t dst_env,
+			   struct Page_map *maps, unsigned n);
+int	sys_page_reserve(envid_t env, void *pg, size_t len, int perm);
 int	sys_page_unmap(envid_t env, void *pg);
+int	sys_page_unmap_range(envid_t env, void *pg, size_t len);
+int	sys_page_protect_range(envid_t env, void *pg, size_t len, int perm);
+envid_t	sys_fork(void);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int	sys_ipc_recv(void *rcv_pg);
 
@@ -72,8 +82,8 @@ void	ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int32_t ipc_recv(envid_t *from_env_store, void *pg, int *perm_store);
 
 // fork.c
-#define	PTE_SHARE	0x400
 envid_t	fork(void);
+envid_t	ufork(void);
 envid_t	sfork(void);	// Challenge!
 
 // fd.c
@@ -17,7 +17,7 @@
 #define GD_KD     0x10     // kernel data
 #define GD_UT     0x18     // user text
 #define GD_UD     0x20     // user data
-#define GD_TSS    0x28     // Task segment selector
+#define GD_TSS0   0x28     // Task segment selector of CPU 0, one per CPU
 
 /*
  * Virtual memory map:                                Permissions
@@ -36,10 +36,18 @@
  *    KERNBASE ----->  +------------------------------+ 0xf0000000
  *                     |  Cur. Page Table (Kern. RW)  | RW/--  PTSIZE
  *    VPT,KSTACKTOP--> +------------------------------+ 0xefc00000      --+
- *                     |         Kernel Stack         | RW/--  KSTKSIZE   |
+ *                     |     CPU0's Kernel Stack      | RW/--  KSTKSIZE   |
+ *                     | - - - - - - - - - - - - - - -|                   |
+ *                     |      Invalid Memory (*)      | --/--  KSTKGAP    |
+ *                     +------------------------------+                   |
+ *                     |     CPU1's Kernel Stack      | RW/--  KSTKSIZE   |
  *                     | - - - - - - - - - - - - - - -|                 PTSIZE
- *                     |      Invalid Memory (*)      | --/--             |
- *    ULIM     ------> +------------------------------+ 0xef800000      --+
+ *                     |      Invalid Memory (*)      | --/--  KSTKGAP    |
+ *                     +------------------------------+                   |
+ *                     :              .               :                   |
+ *                     +------------------------------+ 0xefa00000        |
+ *                     |      Memory-mapped I/O       | RW/--  PTSIZE/2   |
+ *  ULIM, MMIOBASE --> +------------------------------+ 0xef800000      --+
  *                     |  Cur. Page Table (User R-)   | R-/R-  PTSIZE
  *    UVPT      ---->  +------------------------------+ 0xef400000
  *                     |          RO PAGES            | R-/R-  PTSIZE
@@ -88,6 +96,11 @@
 #define IOPHYSMEM	0x0A0000
 #define EXTPHYSMEM	0x100000
 
+// The application processors start in real mode, so their entry code
+// (kern/mpentry.S) gets copied to this page of base memory, which the
+// page allocator leaves alone.
+#define MPENTRY_PADDR	0x7000
+
 // Virtual page table.  Entry PDX[VPT] in the PD contains a pointer to
 // the page directory itself, thereby turning the PD into a page table,
 // which maps all the PTEs containing the page mappings for the entire
@@ -95,8 +108,13 @@
 #define VPT		(KERNBASE - PTSIZE)
 #define KSTACKTOP	VPT
 #define KSTKSIZE	(8*PGSIZE)   		// size of a kernel stack
+#define KSTKGAP		(8*PGSIZE)		// guard below each stack
 #define ULIM		(KSTACKTOP - PTSIZE) 
 
+// Memory-mapped I/O, such as the local APICs, below the kernel stacks
+#define MMIOBASE	ULIM
+#define MMIOLIM		(MMIOBASE + PTSIZE/2)
+
 /*
  * User read-only mappings! Anything below here til UTOP are readonly to user.
  * They are global pages mapped in at env allocation time.
@@ -189,6 +207,7 @@ extern volatile pde_t vpd[];     // VA of current page directory
  */
 LIST_HEAD(Page_list, Page);
 typedef LIST_ENTRY(Page) Page_LIST_entry_t;
+LIST_HEAD(Rmap_list, Rmap);	// struct Rmap lives in kern/rmap.h
 
 struct Page {
 	Page_LIST_entry_t pp_link;	/* free list link */
@@ -198,6 +217,20 @@ struct Page {
 	// Pages allocated at boot time using pmap.c's
 	// boot_alloc do not have valid reference count fields.
 	uint16_t pp_ref;
+
+	// Buddy allocator tag, only meaningful on the first page of a
+	// free block: it records the order of the page_free_list[] the
+	// block is linked on (see kern/buddy.h).  A page in use as a
+	// user page table counts its present entries there instead, up
+	// to NPTENTRIES, which never looks like a tag.
+	union {
+		uint16_t pp_order;
+		uint16_t pp_nlive;
+	};
+
+	// Reverse map: one entry for every page_insert()ed mapping
+	// of this page.
+	struct Rmap_list pp_rmap;
 };
 
 #endif /* !__ASSEMBLER__ */
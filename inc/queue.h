@@ -30,6 +30,7 @@
  *
  * For Jos, extra comments have been added to this file, and the original
  * TAILQ and CIRCLEQ definitions have been removed.   - August 9, 2005
+ * TAILQ is back, in the same style, for the scheduler's run queue.
  */
 
 #ifndef JOS_INC_QUEUE_H
@@ -216,4 +217,84 @@ struct {								\
 	*(elm)->field.le_prev = LIST_NEXT((elm), field);		\
 } while (0)
 
+/*
+ * Tail queue declarations.
+ *
+ * A tail queue is headed by a pair of pointers, one to the head of the
+ * list and the other to the tail of the list.  The elements are doubly
+ * linked so that an arbitrary element can be removed without a need to
+ * traverse the list.  New elements can be added to the list at the head
+ * or at the end of the list.  A tail queue may only be traversed in the
+ * forward direction.  Its head is declared with TAILQ_HEAD and reset
+ * with TAILQ_INIT (or TAILQ_HEAD_INITIALIZER), like a list.
+ */
+#define	TAILQ_HEAD(name, type)						\
+struct name {								\
+	struct type *tqh_first;	/* first element */			\
+	struct type **tqh_last;	/* addr of last next element */		\
+}
+
+#define	TAILQ_HEAD_INITIALIZER(head)					\
+	{ NULL, &(head).tqh_first }
+
+#define	TAILQ_ENTRY(type)						\
+struct {								\
+	struct type *tqe_next;	/* next element */			\
+	struct type **tqe_prev;	/* address of previous next element */	\
+}
+
+/*
+ * Tail queue functions, named after their list counterparts.
+ */
+#define	TAILQ_EMPTY(head)	((head)->tqh_first == NULL)
+
+#define	TAILQ_FIRST(head)	((head)->tqh_first)
+
+#define	TAILQ_NEXT(elm, field)	((elm)->field.tqe_next)
+
+#define	TAILQ_FOREACH(var, head, field)					\
+	for ((var) = TAILQ_FIRST((head));				\
+	    (var);							\
+	    (var) = TAILQ_NEXT((var), field))
+
+#define	TAILQ_INIT(head) do {						\
+	TAILQ_FIRST((head)) = NULL;					\
+	(head)->tqh_last = &TAILQ_FIRST((head));			\
+} while (0)
+
+/*
+ * Insert the element "elm" at the head of the queue named "head".
+ */
+#define	TAILQ_INSERT_HEAD(head, elm, field) do {			\
+	if ((TAILQ_NEXT((elm), field) = TAILQ_FIRST((head))) != NULL)	\
+		TAILQ_FIRST((head))->field.tqe_prev =			\
+		    &TAILQ_NEXT((elm), field);				\
+	else								\
+		(head)->tqh_last = &TAILQ_NEXT((elm), field);		\
+	TAILQ_FIRST((head)) = (elm);					\
+	(elm)->field.tqe_prev = &TAILQ_FIRST((head));			\
+} while (0)
+
+/*
+ * Insert the element "elm" at the end of the queue named "head".
+ */
+#define	TAILQ_INSERT_TAIL(head, elm, field) do {			\
+	TAILQ_NEXT((elm), field) = NULL;				\
+	(elm)->field.tqe_prev = (head)->tqh_last;			\
+	*(head)->tqh_last = (elm);					\
+	(head)->tqh_last = &TAILQ_NEXT((elm), field);			\
+} while (0)
+
+/*
+ * Remove the element "elm" from the queue named "head".
+ */
+#define	TAILQ_REMOVE(head, elm, field) do {				\
+	if ((TAILQ_NEXT((elm), field)) != NULL)				\
+		TAILQ_NEXT((elm), field)->field.tqe_prev = 		\
+		    (elm)->field.tqe_prev;				\
+	else								\
+		(head)->tqh_last = (elm)->field.tqe_prev;		\
+	*(elm)->field.tqe_prev = TAILQ_NEXT((elm), field);		\
+} while (0)
+
 #endif	/* !_SYS_QUEUE_H_ */
@@ -18,7 +18,27 @@ enum
 	SYS_yield,
 	SYS_ipc_try_send,
 	SYS_ipc_recv,
+	SYS_page_alloc_zeroed,
+	SYS_page_alloc_large,
+	SYS_page_map_batch,
+	SYS_fork,
+	SYS_page_reserve,
+	SYS_page_unmap_range,
+	SYS_page_protect_range,
+	SYS_env_set_priority,
+	SYS_env_cputime,
 	NSYSCALLS
 };
 
+// One entry of a sys_page_map_batch() request
+struct Page_map {
+	void *pm_srcva;		// page to map, in the source environment
+	void *pm_dstva;		// where to map it in the destination
+	int pm_perm;		// permissions, as for sys_page_map()
+	int pm_status;		// result, filled in by the kernel
+};
+
+// Most entries a single sys_page_map_batch() call accepts
+#define PAGE_MAP_MAX	256
+
 #endif /* !JOS_INC_SYSCALL_H */
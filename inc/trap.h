@@ -32,9 +32,13 @@
 // Hardware IRQ numbers. We receive these as (IRQ_OFFSET+IRQ_WHATEVER)
 #define IRQ_TIMER        0
 #define IRQ_KBD          1
+#define IRQ_SERIAL       4
 #define IRQ_SPURIOUS     7
 #define IRQ_IDE         14
 #define IRQ_ERROR       19
+// Interprocessor interrupts, sent through the local APICs
+#define IRQ_RESCHED     20	// look at the run queues, see sched_kick()
+#define IRQ_TLB         21	// flush the TLB, see tlb_shootdown()
 
 #ifndef __ASSEMBLER__
 
@@ -28,6 +28,7 @@ static __inline uint32_t rcr3(void) __attribute__((always_inline));
 static __inline void lcr4(uint32_t val) __attribute__((always_inline));
 static __inline uint32_t rcr4(void) __attribute__((always_inline));
 static __inline void tlbflush(void) __attribute__((always_inline));
+static __inline uint32_t xchg(volatile uint32_t *addr, uint32_t newval) __attribute__((always_inline));
 static __inline uint32_t read_eflags(void) __attribute__((always_inline));
 static __inline void write_eflags(uint32_t eflags) __attribute__((always_inline));
 static __inline uint32_t read_ebp(void) __attribute__((always_inline));
@@ -298,4 +299,17 @@ wrmsr(uint32_t msr, uint32_t val1, uint32_t val2)
 		: "c" (msr), "a" (val1), "d" (val2));
 }
 
+static __inline uint32_t
+xchg(volatile uint32_t *addr, uint32_t newval)
+{
+	uint32_t result;
+
+	// The + in "+m" denotes a read-modify-write operand.
+	__asm __volatile("lock; xchgl %0, %1"
+		: "+m" (*addr), "=a" (result)
+		: "1" (newval)
+		: "cc");
+	return result;
+}
+
 #endif /* !JOS_INC_X86_H */
@@ -7,6 +7,8 @@
 #endif
 
 #define MAX_ORDER       11
+// order of a block backing one 4MB superpage (PTSIZE)
+#define SUPERPAGE_ORDER	(PTSHIFT - PGSHIFT)
 #define BUDDY_OF(p, order) \
 	({\
 	 ppn_t pn = page2ppn(p);\
@@ -23,6 +25,18 @@
 #define PAGE_MARK_ALLOC(p)      { (p)->pp_link.le_next = (struct Page *)ALLOC_MAGIC; }
 #define PAGE_MARK_FREE(p)       { (p)->pp_link.le_next = 0; }
 
+// The head page of every free block carries a tag recording the order
+// it is linked on, so deciding whether a buddy can be merged only looks
+// at one struct Page instead of all (1 << order) of them.
+// Neither 0 (page_initpp) nor 0xffff (i386_vm_init) is a valid tag.
+#define FREE_TAG		0xf100
+#define BUDDY_TAG(order)	(FREE_TAG | (order))
+#define PAGE_IS_FREE_HEAD(p, order) ((p)->pp_order == BUDDY_TAG(order))
+#define PAGE_IS_FREE_ANY(p)     (((p)->pp_order & 0xff00) == FREE_TAG)
+#define PAGE_FREE_ORDER(p)      ((p)->pp_order & 0xff)
+#define PAGE_TAG_FREE(p, order) { (p)->pp_order = BUDDY_TAG(order); }
+#define PAGE_UNTAG(p)           { (p)->pp_order = 0; }
+
 // Record a region of physical memory
 typedef struct mem_chunk
 {
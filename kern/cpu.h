@@ -0,0 +1,59 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_CPU_H
+#define JOS_KERN_CPU_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/memlayout.h>
+#include <inc/mmu.h>
+#include <inc/env.h>
+
+// Most CPUs the kernel keeps state for
+#define NCPU		8
+
+// Values of cpu_status in struct Cpu
+#define CPU_UNUSED	0		// slot not used
+#define CPU_STARTED	1		// running the kernel
+#define CPU_HALTED	2		// found in the MP tables, not started
+
+// Per-CPU state
+struct Cpu {
+	uint8_t cpu_id;			// index into cpus[]
+	uint8_t cpu_apicid;		// local APIC id, from the MP tables
+	volatile unsigned cpu_status;	// CPU_*
+	struct Env *cpu_env;		// environment running here, or NULL
+	bool cpu_idle;			// halted in sched_halt()
+	volatile bool cpu_in_user;	// in user mode, see tlb_shootdown()
+	volatile uint32_t cpu_tlb_gen;	// last TLB shootdown caught up with
+	uint64_t cpu_acct_stamp;	// TSC at the last env_charge()
+	struct Taskstate cpu_ts;	// locates this CPU's kernel stack
+};
+
+extern struct Cpu cpus[NCPU];
+extern int ncpu;			// CPUs found by mp_init()
+extern struct Cpu *bootcpu;		// the CPU that booted the kernel
+extern physaddr_t lapicaddr;		// local APIC base, 0 if unknown
+
+// Kernel stacks of the CPUs but the boot one, which runs on bootstack.
+// CPU i's stack is mapped at [CPU_KSTACKTOP(i) - KSTKSIZE,
+// CPU_KSTACKTOP(i)), with an unmapped guard below it.
+extern unsigned char percpu_kstacks[NCPU][KSTKSIZE];
+#define CPU_KSTACKTOP(id)	(KSTACKTOP - (id) * (KSTKSIZE + KSTKGAP))
+
+int	cpunum(void);
+#define thiscpu		(&cpus[cpunum()])
+
+void	mp_init(void);
+
+// Local APIC driver, kern/lapic.c
+void	lapic_init(void);
+void	lapic_startap(uint8_t apicid, physaddr_t addr);
+void	lapic_ipi(uint8_t apicid, int vector);
+void	lapic_eoi(void);
+void	lapic_timer_stop(void);
+void	lapic_timer_start(void);
+
+#endif	// !JOS_KERN_CPU_H
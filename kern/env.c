@@ -12,16 +12,28 @@
 #include <kern/trap.h>
 #include <kern/monitor.h>
 #include <kern/sched.h>
+#include <kern/vma.h>
+#include <kern/spinlock.h>
+#include <kern/picirq.h>
 
 #define KDEBUG
 #include <kern/kdebug.h>
 
 struct Env *envs = NULL;		// All environments
-struct Env *curenv = NULL;	        // The current env
 static struct Env_list env_free_list;	// Free list
 
 #define ENVGENSHIFT	12		// >= LOGNENV
 
+// CPU accounting.  The TSC is read whenever the CPU enters the kernel
+// from user mode and whenever it leaves it again in env_run(), and the
+// cycles since the previous reading are charged to curenv.  Totals are
+// kept separately, so they survive the environments, and summed over
+// the CPUs; each CPU keeps its own last reading, in cpu_acct_stamp.
+static uint64_t acct_user;		// user mode, all envs but envs[0]
+static uint64_t acct_kern;		// kernel, on behalf of those envs
+static uint64_t acct_idle;		// halted, or running envs[0]
+static uint64_t acct_boot;		// kernel, on behalf of nobody
+
 //
 // Converts an envid to an env pointer.
 //
@@ -111,12 +123,10 @@ env_setup_vm(struct Env *e)
 	int i, r;
 	struct Page *p = NULL;
 
-	// Allocate a page for the page directory
-	if ((r = page_alloc(&p)) < 0)
+	// Allocate a cleared page for the page directory
+	if ((r = page_alloc_zeroed(&p)) < 0)
 		return r;
 
-	memset(page2kva(p), 0, PGSIZE);
-
 	// Now, set e->env_pgdir and e->env_cr3,
 	// and initialize the page directory.
 	//
@@ -138,7 +148,8 @@ env_setup_vm(struct Env *e)
 	clone_vm((uintptr_t)e->env_pgdir);
 
 	// VPT and UVPT map the env's own page table, with
-	// different permissions.
+	// different permissions.  Unlike the PTE_G kernel mappings
+	// cloned above, they are private to the env.
 	e->env_pgdir[PDX(VPT)]  = e->env_cr3 | PTE_P | PTE_W;
 	e->env_pgdir[PDX(UVPT)] = e->env_cr3 | PTE_P | PTE_U;
 
@@ -175,8 +186,16 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	
 	// Set the basic status variables.
 	e->env_parent_id = parent_id;
-	e->env_status = ENV_RUNNABLE;
+	e->env_prio = 0;
+	e->env_prio_pinned = 0;
+	e->env_slice_used = 0;
+	e->env_cpunum = cpunum();
+	e->env_running = 0;
+	e->env_dying = 0;
+	sched_set_status(e, ENV_RUNNABLE);
 	e->env_runs = 0;
+	e->env_user_cycles = 0;
+	e->env_kern_cycles = 0;
 
 	// Clear out all the saved register state,
 	// to prevent the register values
@@ -205,6 +224,11 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Also clear the IPC receiving flag.
 	e->env_ipc_recving = 0;
 
+	// Nothing mapped below UTOP yet.
+	e->env_vmas = NULL;
+	e->env_nvmas = 0;
+	e->env_vmas_order = 0;
+
 	// If this is the file server (e == &envs[1]) give it I/O privileges.
 	if (e == &envs[1])
 		e->env_tf.tf_eflags |= FL_IOPL_3;
@@ -236,6 +260,10 @@ segment_alloc(struct Env *e, void *va, size_t len, int rw)
 
 	size_t npages = ROUNDUP(len, PGSIZE) / PGSIZE;
 
+	if (vma_map(e, ROUNDDOWN((uintptr_t) va, PGSIZE),
+		ROUNDUP((uintptr_t) va + len, PGSIZE), perm|PTE_P, VMA_PAGES) < 0)
+		goto seg_alloc_no_mem;
+
 	while (npages--) {
 		struct Page *pp;
 
@@ -391,41 +419,23 @@ env_create(uint8_t *binary, size_t size)
 void
 env_free(struct Env *e)
 {
-	pte_t *pt;
-	uint32_t pdeno, pteno;
 	physaddr_t pa;
 	
 	// If freeing the current environment, switch to boot_pgdir
 	// before freeing the page directory, just in case the page
 	// gets reused.
-	if (e == curenv)
+	if (e == curenv || rcr3() == e->env_cr3)
 		lcr3(boot_cr3);
 
 	// Note the environment's demise.
 	cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
-	// Flush all mapped pages in the user portion of the address space
+	// Flush all mapped pages in the user portion of the address space,
+	// in one sweep since nobody uses it any more
 	static_assert(UTOP % PTSIZE == 0);
-	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
-
-		// only look at mapped page tables
-		if (!(e->env_pgdir[pdeno] & PTE_P))
-			continue;
+	pgdir_teardown(e->env_pgdir);
 
-		// find the pa and va of the page table
-		pa = PTE_ADDR(e->env_pgdir[pdeno]);
-		pt = (pte_t*) KADDR(pa);
-
-		// unmap all PTEs in this page table
-		for (pteno = 0; pteno <= PTX(~0); pteno++) {
-			if (pt[pteno] & PTE_P)
-				page_remove(e->env_pgdir, PGADDR(pdeno, pteno, 0));
-		}
-
-		// free the page table itself
-		e->env_pgdir[pdeno] = 0;
-		page_decref(pa2page(pa));
-	}
+	vma_free(e);
 
 	// free the page directory
 	pa = e->env_cr3;
@@ -434,7 +444,7 @@ env_free(struct Env *e)
 	page_decref(pa2page(pa));
 
 	// return the environment to the free list
-	e->env_status = ENV_FREE;
+	sched_set_status(e, ENV_FREE);
 	LIST_INSERT_HEAD(&env_free_list, e, env_link);
 }
 
@@ -442,10 +452,20 @@ env_free(struct Env *e)
 // Frees environment e.
 // If e was the current env, then runs a new environment (and does not return
 // to the caller).
+// If e runs on another CPU, that one frees it as soon as it enters the
+// kernel, which it is made to.
 //
 void
 env_destroy(struct Env *e) 
 {
+	// its page directory is loaded there, so leave it alone for now
+	if (e->env_running && e != curenv) {
+		e->env_dying = 1;
+		lapic_ipi(cpus[e->env_cpunum].cpu_apicid,
+			  IRQ_OFFSET + IRQ_RESCHED);
+		return;
+	}
+
 	env_free(e);
 
 	if (curenv == e) {
@@ -493,9 +513,131 @@ env_run(struct Env *e)
 	//	e->env_tf.  Go back through the code you wrote above
 	//	and make sure you have set the relevant parts of
 	//	e->env_tf to sensible values.
+	env_charge(0);
+	thiscpu->cpu_idle = 0;
+
 	curenv = e;
 	e->env_runs++;
 	lcr3(e->env_cr3);
+
+	// from here on, nothing but this CPU's stack and 'e' gets touched
+	unlock_kernel();
+	thiscpu->cpu_in_user = 1;
 	env_pop_tf(&e->env_tf);
 }
 
+
+//
+// Charge the cycles since the last call to curenv, as user time if
+// 'user' is set (the CPU just trapped into the kernel) or as kernel
+// time otherwise (it is about to return to user mode).
+//
+void
+env_charge(bool user)
+{
+	uint64_t now = read_tsc();
+	uint64_t delta = now - thiscpu->cpu_acct_stamp;
+
+	thiscpu->cpu_acct_stamp = now;
+	if (!curenv && thiscpu->cpu_idle) {
+		acct_idle += delta;
+		return;
+	}
+	if (!curenv || curenv->env_status == ENV_FREE) {
+		// boot, or curenv destroyed itself
+		acct_boot += delta;
+		return;
+	}
+
+	if (user)
+		curenv->env_user_cycles += delta;
+	else
+		curenv->env_kern_cycles += delta;
+
+	if (curenv == &envs[0])
+		acct_idle += delta;
+	else if (user)
+		acct_user += delta;
+	else
+		acct_kern += delta;
+}
+
+//
+// Fill in 'ct' with the CPU time used by 'e' so far.
+// Time in the kernel is charged up to now if 'e' is curenv.
+//
+void
+env_cputime(struct Env *e, struct Env_cputime *ct)
+{
+	if (e == curenv)
+		env_charge(0);
+
+	ct->ct_user = e->env_user_cycles;
+	ct->ct_kern = e->env_kern_cycles;
+	ct->ct_runs = e->env_runs;
+}
+
+static uint64_t
+env_cycles(struct Env *e)
+{
+	return e->env_user_cycles + e->env_kern_cycles;
+}
+
+// Per mille of 'part' in 'total'
+static uint32_t
+permille(uint64_t part, uint64_t total)
+{
+	return total ? part * 1000 / total : 0;
+}
+
+//
+// List the live environments, busiest first, with their share of all
+// the cycles counted since boot.
+//
+void
+env_cpu_info(void)
+{
+	static struct Env *sorted[NENV];
+	static const char *status_name[] = {
+		[ENV_FREE]		= "free",
+		[ENV_RUNNABLE]		= "run",
+		[ENV_NOT_RUNNABLE]	= "wait",
+	};
+	struct Env *e;
+	uint64_t total;
+	uint32_t pm;
+	int i, j, n;
+
+	env_charge(0);
+	total = acct_user + acct_kern + acct_idle + acct_boot;
+
+	// insertion sort, by cycles used
+	n = 0;
+	for (e = envs; e < envs + NENV; e++) {
+		if (e->env_status == ENV_FREE)
+			continue;
+		for (j = n++; j > 0 && env_cycles(sorted[j - 1]) < env_cycles(e); j--)
+			sorted[j] = sorted[j - 1];
+		sorted[j] = e;
+	}
+
+	pm = permille(acct_user, total);
+	cprintf("cpu: %u.%u%% user, ", pm / 10, pm % 10);
+	pm = permille(acct_kern, total);
+	cprintf("%u.%u%% kernel, ", pm / 10, pm % 10);
+	pm = permille(acct_idle, total);
+	cprintf("%u.%u%% idle, ", pm / 10, pm % 10);
+	pm = permille(acct_boot, total);
+	cprintf("%u.%u%% other\n", pm / 10, pm % 10);
+
+	cprintf("%-8s %-4s %4s %8s %14s %14s %6s\n", "envid", "stat",
+		"prio", "runs", "user", "kernel", "cpu");
+	for (i = 0; i < n; i++) {
+		e = sorted[i];
+		pm = permille(env_cycles(e), total);
+		cprintf("%08x %-4s %4d %8u %14llu %14llu %3u.%u%%\n",
+			e->env_id, status_name[e->env_status], e->env_prio,
+			e->env_runs, e->env_user_cycles, e->env_kern_cycles,
+			pm / 10, pm % 10);
+	}
+}
@@ -4,6 +4,7 @@
 #define JOS_KERN_ENV_H
 
 #include <inc/env.h>
+#include <kern/cpu.h>
 
 #ifndef JOS_MULTIENV
 // Change this value to 1 once you're allowing multiple environments
@@ -12,7 +13,7 @@
 #endif
 
 extern struct Env *envs;		// All environments
-extern struct Env *curenv;	        // Current environment
+#define curenv (thiscpu->cpu_env)	// Current environment
 
 LIST_HEAD(Env_list, Env);		// Declares 'struct Env_list'
 
@@ -22,6 +23,10 @@ void	env_free(struct Env *e);
 void	env_create(uint8_t *binary, size_t size);
 void	env_destroy(struct Env *e);	// Does not return if e == curenv
 
+void	env_charge(bool user);
+void	env_cputime(struct Env *e, struct Env_cputime *ct);
+void	env_cpu_info(void);
+
 int	envid2env(envid_t envid, struct Env **env_store, bool checkperm);
 // The following two functions do not return
 void	env_run(struct Env *e) __attribute__((noreturn));
@@ -3,15 +3,22 @@
 #include <inc/stdio.h>
 #include <inc/string.h>
 #include <inc/assert.h>
+#include <inc/x86.h>
 
 #include <kern/monitor.h>
 #include <kern/console.h>
 #include <kern/pmap.h>
+#include <kern/kmem.h>
+#include <kern/rmap.h>
 #include <kern/kclock.h>
 #include <kern/env.h>
 #include <kern/trap.h>
 #include <kern/sched.h>
 #include <kern/picirq.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+
+static void boot_aps(void);
 
 
 void
@@ -30,22 +37,33 @@ i386_init(void)
 
 	cprintf("6828 decimal is %o octal!\n", 6828);
 
-	enable_sep();
-
 	// Lab 2 memory management initialization functions
 	i386_detect_memory();
 	i386_vm_init();
 	page_init();
 	page_check();
+	kmem_init();
+	rmap_init();
+
+	// Find the CPUs, the boot one's state is per-CPU from here on
+	mp_init();
+	lapic_init();
+	enable_sep();
 
 	// Lab 3 user environment initialization functions
 	env_init();
+	sched_init();
 	idt_init();
 
 	// Lab 4 multitasking initialization functions
 	pic_init();
 	kclock_init();
 
+	// Acquire the big kernel lock before waking up the APs, which
+	// wait for it until the first environment runs.
+	lock_kernel();
+	boot_aps();
+
 	// Should always have an idle process as first one.
 	ENV_CREATE(user_idle);
 
@@ -65,6 +83,90 @@ i386_init(void)
 }
 
 
+// While boot_aps() starts an AP: the top of its kernel stack, and the
+// page directory kern/mpentry.S turns paging on with.
+void *mpentry_kstack;
+physaddr_t mpentry_cr3;
+
+//
+// Start the application processors, one after the other.
+//
+static void
+boot_aps(void)
+{
+	extern unsigned char mpentry_start[], mpentry_end[];
+	struct Page *pp;
+	struct Cpu *c;
+	pde_t *pgdir;
+
+	if (ncpu == 1)
+		return;
+
+	// Write entry code to unused memory at MPENTRY_PADDR
+	memmove(KADDR(MPENTRY_PADDR), mpentry_start,
+		mpentry_end - mpentry_start);
+
+	// The AP turns paging on while it still runs at MPENTRY_PADDR,
+	// so its first page directory maps VA 0:4MB same as VA KERNBASE,
+	// like the one i386_vm_init() starts the boot CPU with.
+	if (page_alloc(&pp) < 0)
+		panic("boot_aps: out of memory");
+	pgdir = page2kva(pp);
+	memmove(pgdir, boot_pgdir, PGSIZE);
+	pgdir[0] = boot_pgdir[PDX(KERNBASE)] & ~PTE_G;
+	mpentry_cr3 = page2pa(pp);
+
+	for (c = cpus; c < cpus + ncpu; c++) {
+		if (c == bootcpu)
+			continue;
+
+		mpentry_kstack = (void *) CPU_KSTACKTOP(c->cpu_id);
+		lapic_startap(c->cpu_apicid, MPENTRY_PADDR);
+		// Wait for the CPU to finish some basic setup in mp_main()
+		while (c->cpu_status != CPU_STARTED)
+			;
+	}
+
+	// every AP left that page directory in mp_main()
+	page_free(pp);
+}
+
+// Setup code for APs, called by kern/mpentry.S
+void
+mp_main(void)
+{
+	uint32_t cr4;
+
+	// Reload all segment registers, from the kernel's gdt.
+	asm volatile("lgdt gdt_pd");
+	asm volatile("movw %%ax,%%gs" :: "a" (GD_UD|3));
+	asm volatile("movw %%ax,%%fs" :: "a" (GD_UD|3));
+	asm volatile("movw %%ax,%%es" :: "a" (GD_KD));
+	asm volatile("movw %%ax,%%ds" :: "a" (GD_KD));
+	asm volatile("movw %%ax,%%ss" :: "a" (GD_KD));
+	asm volatile("ljmp %0,$1f\n 1:\n" :: "i" (GD_KT));  // reload cs
+	asm volatile("lldt %%ax" :: "a" (0));
+
+	// We are in high EIP now, safe to switch to boot_pgdir, and to
+	// enable global pages as i386_vm_init() does.
+	lcr3(boot_cr3);
+	cr4 = rcr4();
+	cr4 |= CR4_PGE;
+	lcr4(cr4);
+
+	lapic_init();
+	trap_init_percpu();
+	enable_sep();
+	xchg(&thiscpu->cpu_status, CPU_STARTED); // tell boot_aps() we're up
+
+	// Wait for the boot CPU to run its first environment, then look
+	// for one to run here.
+	lock_kernel();
+	cprintf("SMP: CPU %d starting\n", cpunum());
+	sched_yield();
+}
+
+
 /*
  * Variable panicstr contains argument to first call to panic; used as flag
  * to indicate that the kernel has already called panic.
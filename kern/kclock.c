@@ -29,15 +29,38 @@ mc146818_write(unsigned reg, unsigned datum)
 }
 
 
-void
-kclock_init(void)
+static void
+kclock_rategen(void)
 {
-	/* initialize 8253 clock to interrupt 100 times/sec */
+	/* program 8253 clock to interrupt 100 times/sec */
 	outb(TIMER_MODE, TIMER_SEL0 | TIMER_RATEGEN | TIMER_16BIT);
 	outb(IO_TIMER1, TIMER_DIV(100) % 256);
 	outb(IO_TIMER1, TIMER_DIV(100) / 256);
+}
+
+void
+kclock_init(void)
+{
+	kclock_rategen();
 	cprintf("	Setup timer interrupts via 8259A\n");
 	irq_setmask_8259A(irq_mask_8259A & ~(1<<0));
 	cprintf("	unmasked timer interrupt\n");
 }
 
+/*
+ * Stop the clock interrupts, while the CPU idles.  In mode 0 the
+ * counter waits for a count to be loaded, so it stays quiet and IRQ 0
+ * can stay unmasked; irq_setmask_8259A() would print on every idle.
+ */
+void
+kclock_stop(void)
+{
+	outb(TIMER_MODE, TIMER_SEL0 | TIMER_INTTC | TIMER_16BIT);
+}
+
+void
+kclock_start(void)
+{
+	kclock_rategen();
+}
+
@@ -29,5 +29,7 @@
 unsigned mc146818_read(unsigned reg);
 void mc146818_write(unsigned reg, unsigned datum);
 void kclock_init(void);
+void kclock_stop(void);
+void kclock_start(void);
 
 #endif	// !JOS_KERN_KCLOCK_H
@@ -0,0 +1,220 @@
+/* See COPYRIGHT for copyright information. */
+
+#include <inc/mmu.h>
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+
+#include <kern/pmap.h>
+#include <kern/kmem.h>
+
+#define KDEBUG
+#include <kern/kdebug.h>
+
+// A slab should hold at least this many objects, unless that would make
+// it larger than (PGSIZE << KMEM_MAX_ORDER).
+#define KMEM_MIN_PERSLAB	8
+#define KMEM_MAX_ORDER		3
+
+// Free list link of a slot, stored right behind the object
+#define FREE_LINK(cp, obj) \
+	(*(void **) ((char *) (obj) + ROUNDUP((cp)->kc_objsize, sizeof(void *))))
+
+// Start of the first object in a slab
+#define SLAB_OBJS(cp, sp) \
+	((char *) (sp) + ROUNDUP(sizeof(struct Slab), (cp)->kc_align))
+
+LIST_HEAD(Kmem_cache_list, Kmem_cache);
+static struct Kmem_cache_list kmem_caches;
+
+// The caches' own descriptors are allocated from this cache.
+static struct Kmem_cache kmem_cache_cache;
+
+static void
+cache_setup(struct Kmem_cache *cp, const char *name, size_t size,
+	    size_t align, void (*ctor)(void *))
+{
+	size_t avail;
+
+	if (align < sizeof(void *))
+		align = sizeof(void *);
+	assert((align & (align - 1)) == 0);
+
+	memset(cp, 0, sizeof(*cp));
+	cp->kc_name = name;
+	cp->kc_objsize = size;
+	cp->kc_align = align;
+	cp->kc_ctor = ctor;
+	cp->kc_slotsize = ROUNDUP(ROUNDUP(size, sizeof(void *)) +
+				  sizeof(void *), align);
+
+	// pick the smallest slab that holds enough objects
+	for (cp->kc_order = 0; ; cp->kc_order++) {
+		avail = (PGSIZE << cp->kc_order) -
+			ROUNDUP(sizeof(struct Slab), align);
+		cp->kc_perslab = avail / cp->kc_slotsize;
+		if (cp->kc_perslab >= KMEM_MIN_PERSLAB ||
+		    cp->kc_order == KMEM_MAX_ORDER)
+			break;
+	}
+	assert(cp->kc_perslab > 0);
+
+	LIST_INIT(&cp->kc_partial);
+	LIST_INIT(&cp->kc_full);
+	LIST_INIT(&cp->kc_empty);
+	LIST_INSERT_HEAD(&kmem_caches, cp, kc_link);
+}
+
+void
+kmem_init(void)
+{
+	LIST_INIT(&kmem_caches);
+	cache_setup(&kmem_cache_cache, "kmem_cache",
+		    sizeof(struct Kmem_cache), 0, NULL);
+}
+
+//
+// Create a cache of objects of 'size' bytes, each aligned on 'align'
+// (a power of two, 0 means pointer alignment).  If 'ctor' is given it
+// is run on every object when its slab is created, so objects come out
+// of kmem_cache_alloc() in constructed state and should be handed back
+// to kmem_cache_free() in that state as well.
+//
+// Returns NULL if out of memory.
+//
+struct Kmem_cache *
+kmem_cache_create(const char *name, size_t size, size_t align,
+		  void (*ctor)(void *))
+{
+	struct Kmem_cache *cp;
+
+	if (!(cp = kmem_cache_alloc(&kmem_cache_cache)))
+		return NULL;
+
+	cache_setup(cp, name, size, align, ctor);
+	DBG(C_MEM_ALLOC, KDEBUG_FLOW,
+		"new slab cache %s: size %d, %d objs per order-%d slab\n",
+		name, size, cp->kc_perslab, cp->kc_order);
+	return cp;
+}
+
+static struct Slab *
+slab_create(struct Kmem_cache *cp)
+{
+	struct Page *pp;
+	struct Slab *sp;
+	char *obj;
+	int i;
+
+	if (pages_alloc(&pp, cp->kc_order) < 0)
+		return NULL;
+
+	sp = page2kva(pp);
+	sp->sl_cache = cp;
+	sp->sl_inuse = 0;
+	sp->sl_free = NULL;
+
+	// thread the free list in reverse, so objects are handed out
+	// in address order
+	for (i = cp->kc_perslab - 1; i >= 0; i--) {
+		obj = SLAB_OBJS(cp, sp) + i * cp->kc_slotsize;
+		if (cp->kc_ctor)
+			cp->kc_ctor(obj);
+		FREE_LINK(cp, obj) = sp->sl_free;
+		sp->sl_free = obj;
+	}
+
+	cp->kc_nslabs++;
+	return sp;
+}
+
+static void
+slab_destroy(struct Kmem_cache *cp, struct Slab *sp)
+{
+	assert(sp->sl_inuse == 0);
+	cp->kc_nslabs--;
+	pages_free(kva2page((uintptr_t) sp), cp->kc_order);
+}
+
+//
+// Allocate one object from cache 'cp'.
+// Returns NULL if out of memory.
+//
+void *
+kmem_cache_alloc(struct Kmem_cache *cp)
+{
+	struct Slab *sp;
+	void *obj;
+
+	if (!(sp = LIST_FIRST(&cp->kc_partial))) {
+		if ( (sp = LIST_FIRST(&cp->kc_empty))) {
+			LIST_REMOVE(sp, sl_link);
+			cp->kc_nempty--;
+		} else if (!(sp = slab_create(cp)))
+			return NULL;
+		LIST_INSERT_HEAD(&cp->kc_partial, sp, sl_link);
+	}
+
+	obj = sp->sl_free;
+	sp->sl_free = FREE_LINK(cp, obj);
+
+	if (++sp->sl_inuse == cp->kc_perslab) {
+		LIST_REMOVE(sp, sl_link);
+		LIST_INSERT_HEAD(&cp->kc_full, sp, sl_link);
+	}
+
+	cp->kc_inuse++;
+	cp->kc_nallocs++;
+	return obj;
+}
+
+//
+// Return 'obj' to cache 'cp'.
+// At most one empty slab is kept per cache, the others go back to the
+// buddy system right away.
+//
+void
+kmem_cache_free(struct Kmem_cache *cp, void *obj)
+{
+	struct Slab *sp;
+
+	sp = ROUNDDOWN(obj, PGSIZE << cp->kc_order);
+	assert(sp->sl_cache == cp);
+	assert(sp->sl_inuse > 0);
+
+	if (sp->sl_inuse == cp->kc_perslab) {
+		LIST_REMOVE(sp, sl_link);
+		LIST_INSERT_HEAD(&cp->kc_partial, sp, sl_link);
+	}
+
+	FREE_LINK(cp, obj) = sp->sl_free;
+	sp->sl_free = obj;
+	cp->kc_inuse--;
+
+	if (--sp->sl_inuse == 0) {
+		LIST_REMOVE(sp, sl_link);
+		if (cp->kc_nempty)
+			slab_destroy(cp, sp);
+		else {
+			LIST_INSERT_HEAD(&cp->kc_empty, sp, sl_link);
+			cp->kc_nempty++;
+		}
+	}
+}
+
+void
+kmem_info(void)
+{
+	struct Kmem_cache *cp;
+	uint32_t total;
+
+	cprintf("%-16s %7s %7s %7s %5s %5s %4s %8s\n", "cache", "objsize",
+		"inuse", "total", "slabs", "pages", "use%", "allocs");
+	LIST_FOREACH(cp, &kmem_caches, kc_link) {
+		total = cp->kc_nslabs * cp->kc_perslab;
+		cprintf("%-16s %7d %7u %7u %5u %5u %3u%% %8u\n", cp->kc_name,
+			cp->kc_objsize, cp->kc_inuse, total, cp->kc_nslabs,
+			cp->kc_nslabs << cp->kc_order,
+			total ? cp->kc_inuse * 100 / total : 0, cp->kc_nallocs);
+	}
+}
@@ -0,0 +1,57 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_KMEM_H
+#define JOS_KERN_KMEM_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/queue.h>
+
+// Slab allocator for fixed-size kernel objects, built on pages_alloc().
+//
+// Each cache carves blocks of (1 << kc_order) pages into equally sized
+// slots.  A slab keeps its bookkeeping (struct Slab) at the start of the
+// block, so the slab of an object is found by rounding its address down.
+// The free list link of a slot lives right behind the object itself,
+// so objects keep their constructed state while they sit in the cache.
+
+LIST_HEAD(Slab_list, Slab);
+
+struct Slab {
+	LIST_ENTRY(Slab) sl_link;	// partial/full/free list link
+	struct Kmem_cache *sl_cache;	// cache this slab belongs to
+	void *sl_free;			// first free object
+	int sl_inuse;			// number of allocated objects
+};
+
+struct Kmem_cache {
+	const char *kc_name;
+	size_t kc_objsize;		// size requested by the user
+	size_t kc_slotsize;		// object + free link, aligned
+	size_t kc_align;		// alignment of every object
+	void (*kc_ctor)(void *obj);	// called once per object per slab
+	int kc_order;			// slab size is (PGSIZE << kc_order)
+	int kc_perslab;			// objects per slab
+
+	struct Slab_list kc_partial;	// slabs with free and used objects
+	struct Slab_list kc_full;	// slabs without free objects
+	struct Slab_list kc_empty;	// slabs without used objects
+
+	uint32_t kc_nslabs;		// slabs owned by this cache
+	uint32_t kc_nempty;		// slabs on kc_empty
+	uint32_t kc_inuse;		// objects handed out
+	uint32_t kc_nallocs;		// successful kmem_cache_alloc() calls
+
+	LIST_ENTRY(Kmem_cache) kc_link;	// link on the list of all caches
+};
+
+void	kmem_init(void);
+struct Kmem_cache *kmem_cache_create(const char *name, size_t size,
+				     size_t align, void (*ctor)(void *));
+void	*kmem_cache_alloc(struct Kmem_cache *cp);
+void	kmem_cache_free(struct Kmem_cache *cp, void *obj);
+void	kmem_info(void);
+
+#endif	// !JOS_KERN_KMEM_H
@@ -0,0 +1,222 @@
+/* See COPYRIGHT for copyright information. */
+
+/* The local APIC of each CPU: its clock, its end of interrupts, and
+ * the interprocessor interrupts that start the application processors
+ * and let the CPUs poke each other.
+ */
+
+#include <inc/types.h>
+#include <inc/memlayout.h>
+#include <inc/trap.h>
+#include <inc/mmu.h>
+#include <inc/x86.h>
+
+#include <kern/cpu.h>
+#include <kern/picirq.h>
+#include <kern/pmap.h>
+#include <kern/kclock.h>
+
+// Local APIC registers, divided by 4 for use as uint32_t[] indices.
+#define ID      (0x0020/4)   // ID
+#define VER     (0x0030/4)   // Version
+#define TPR     (0x0080/4)   // Task Priority
+#define EOI     (0x00B0/4)   // EOI
+#define SVR     (0x00F0/4)   // Spurious Interrupt Vector
+	#define ENABLE     0x00000100   // Unit Enable
+#define ESR     (0x0280/4)   // Error Status
+#define ICRLO   (0x0300/4)   // Interrupt Command
+	#define INIT       0x00000500   // INIT/RESET
+	#define STARTUP    0x00000600   // Startup IPI
+	#define DELIVS     0x00001000   // Delivery status
+	#define ASSERT     0x00004000   // Assert interrupt (vs deassert)
+	#define DEASSERT   0x00000000
+	#define LEVEL      0x00008000   // Level triggered
+	#define BCAST      0x00080000   // Send to all APICs, including self.
+	#define FIXED      0x00000000
+#define ICRHI   (0x0310/4)   // Interrupt Command [63:32]
+#define TIMER   (0x0320/4)   // Local Vector Table 0 (TIMER)
+	#define X1         0x0000000B   // divide counts by 1
+	#define PERIODIC   0x00020000   // Periodic
+#define PCINT   (0x0340/4)   // Performance Counter LVT
+#define LINT0   (0x0350/4)   // Local Vector Table 1 (LINT0)
+#define LINT1   (0x0360/4)   // Local Vector Table 2 (LINT1)
+#define ERROR   (0x0370/4)   // Local Vector Table 3 (ERROR)
+	#define MASKED     0x00010000   // Interrupt masked
+#define TICR    (0x0380/4)   // Timer Initial Count
+#define TCCR    (0x0390/4)   // Timer Current Count
+#define TDCR    (0x03E0/4)   // Timer Divide Configuration
+
+// Timer counts between two clock interrupts.  The timer runs at the
+// bus clock, left uncalibrated: at 1GHz that is about 100Hz,
+// like the PIT of the boot CPU.
+#define LAPIC_TIMER_COUNT	10000000
+
+// The local APIC registers, mapped by lapic_init(); NULL until then,
+// or for good on a uniprocessor without MP tables.
+static volatile uint32_t *lapic;
+
+static void
+lapicw(int index, int value)
+{
+	lapic[index] = value;
+	lapic[ID];  // wait for write to finish, by reading
+}
+
+//
+// Set up the local APIC of the CPU executing this.  The first call,
+// on the boot CPU, maps the registers for all of them.
+//
+void
+lapic_init(void)
+{
+	if (!lapicaddr)
+		return;
+	if (!lapic)
+		lapic = mmio_map_region(lapicaddr, PGSIZE);
+
+	// Enable local APIC; set spurious interrupt vector.
+	lapicw(SVR, ENABLE | (IRQ_OFFSET + IRQ_SPURIOUS));
+
+	// The timer drives the scheduler of the application processors.
+	// The boot CPU keeps the PIT (kern/kclock.c), so its timer stays
+	// masked.  Both deliver IRQ_TIMER.
+	lapicw(TDCR, X1);
+	lapicw(TIMER, PERIODIC | (IRQ_OFFSET + IRQ_TIMER) |
+		(thiscpu == bootcpu ? MASKED : 0));
+	lapicw(TICR, LAPIC_TIMER_COUNT);
+
+	// Leave LINT0 of the boot CPU enabled, it gets the interrupts of
+	// the 8259s through it.  Disable it on the others.
+	if (thiscpu != bootcpu)
+		lapicw(LINT0, MASKED);
+
+	// Disable NMI (LINT1) on all CPUs
+	lapicw(LINT1, MASKED);
+
+	// Disable performance counter overflow interrupts
+	// on machines that provide that interrupt entry.
+	if (((lapic[VER]>>16) & 0xFF) >= 4)
+		lapicw(PCINT, MASKED);
+
+	// Map error interrupt to IRQ_ERROR.
+	lapicw(ERROR, IRQ_OFFSET + IRQ_ERROR);
+
+	// Clear error status register (requires back-to-back writes).
+	lapicw(ESR, 0);
+	lapicw(ESR, 0);
+
+	// Ack any outstanding interrupts.
+	lapicw(EOI, 0);
+
+	// Send an Init Level De-Assert to synchronize arbitration ID's.
+	lapicw(ICRHI, 0);
+	lapicw(ICRLO, BCAST | INIT | LEVEL | DEASSERT);
+	while(lapic[ICRLO] & DELIVS)
+		;
+
+	// Enable interrupts on the APIC (but not on the processor).
+	lapicw(TPR, 0);
+}
+
+//
+// Index of the CPU executing this.
+// Before lapic_init(), only the boot CPU runs.
+//
+int
+cpunum(void)
+{
+	int i, apicid;
+
+	if (!lapic)
+		return bootcpu->cpu_id;
+
+	apicid = lapic[ID] >> 24;
+	for (i = 0; i < ncpu; i++)
+		if (cpus[i].cpu_apicid == apicid)
+			return i;
+	return bootcpu->cpu_id;
+}
+
+// Acknowledge an interrupt delivered by the local APIC: the timer of
+// an application processor, or an interprocessor interrupt.
+void
+lapic_eoi(void)
+{
+	if (lapic)
+		lapicw(EOI, 0);
+}
+
+// Spin for a given number of microseconds, about.
+// Reading port 0x84, which nothing uses, takes a microsecond or so.
+static void
+microdelay(int us)
+{
+	while (us-- > 0)
+		inb(0x84);
+}
+
+//
+// Start the application processor 'apicid' at the real mode address
+// 'addr', which must be page aligned and below 1MB.
+// See Appendix B of the MultiProcessor Specification.
+//
+void
+lapic_startap(uint8_t apicid, physaddr_t addr)
+{
+	uint16_t *wrv;
+	int i;
+
+	// "The BSP must initialize CMOS shutdown code to 0AH
+	// and the warm reset vector (DWORD based at 40:67) to point at
+	// the AP startup code prior to the [universal startup algorithm]."
+	mc146818_write(0xF, 0x0A);		// offset 0xF is shutdown code
+	wrv = (uint16_t *) KADDR((0x40 << 4 | 0x67));	// Warm reset vector
+	wrv[0] = 0;
+	wrv[1] = addr >> 4;
+
+	// "Universal startup algorithm."
+	// Send INIT (level-triggered) interrupt to reset other CPU.
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, INIT | LEVEL | ASSERT);
+	microdelay(200);
+	lapicw(ICRLO, INIT | LEVEL | DEASSERT);
+	microdelay(10000);
+
+	// Send startup IPI (twice!) to enter code.
+	// Regular hardware is supposed to only accept a STARTUP
+	// when it is in the halted state due to an INIT.  So the second
+	// should be ignored, but it is part of the official Intel algorithm.
+	for (i = 0; i < 2; i++) {
+		lapicw(ICRHI, apicid << 24);
+		lapicw(ICRLO, STARTUP | (addr >> 12));
+		microdelay(200);
+	}
+}
+
+// Send the interrupt 'vector' to the CPU 'apicid'.
+void
+lapic_ipi(uint8_t apicid, int vector)
+{
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, FIXED | vector);
+	while (lapic[ICRLO] & DELIVS)
+		;
+}
+
+//
+// Stop the clock interrupts of this CPU while it idles, and restart
+// them, with a fresh period.  For the application processors only,
+// see lapic_init().
+//
+void
+lapic_timer_stop(void)
+{
+	lapicw(TIMER, MASKED | PERIODIC | (IRQ_OFFSET + IRQ_TIMER));
+}
+
+void
+lapic_timer_start(void)
+{
+	lapicw(TIMER, PERIODIC | (IRQ_OFFSET + IRQ_TIMER));
+	lapicw(TICR, LAPIC_TIMER_COUNT);
+}
@@ -13,6 +13,10 @@
 #include <kern/trap.h>
 #include <kern/kdebug.h>
 #include <kern/pmap.h>
+#include <kern/kmem.h>
+#include <kern/buddy.h>
+#include <kern/rmap.h>
+#include <kern/vma.h>
 #include <kern/env.h>
 
 #define CMDBUF_SIZE	80	// enough for one VGA text line
@@ -41,6 +45,12 @@ static struct Command commands[] = {
 	{ "dumpva", "Dump virtual memory contents", mon_dumpva },
 	{ "dumppa", "Dump physical memory contents", mon_dumppa },
 	{ "buddyinfo", "Free memory information", mon_buddyinfo },
+	{ "kmeminfo", "Slab cache utilization", mon_kmeminfo },
+	{ "compact", "Compact memory into a free block", mon_compact },
+	{ "rmap", "Show the mappings of a physical page", mon_rmap },
+	{ "pagecolor", "Turn page coloring of user pages on/off", mon_pagecolor },
+	{ "vma", "Show the memory areas of an environment", mon_vma },
+	{ "top", "Show the CPU time used by each environment", mon_top },
 };
 #define NCOMMANDS (sizeof(commands)/sizeof(commands[0]))
 
@@ -246,6 +256,96 @@ int mon_buddyinfo(int argc, char **argv, struct Trapframe *tf)
 	return 0;
 }
 
+int mon_kmeminfo(int argc, char **argv, struct Trapframe *tf)
+{
+	kmem_info();
+	return 0;
+}
+
+int mon_compact(int argc, char **argv, struct Trapframe *tf)
+{
+	struct Page *pp;
+	int order;
+
+	if (argc != 2) {
+		cprintf("usage: %s <order>\n", argv[0]);
+		return 0;
+	}
+
+	order = strtol(argv[1], NULL, 0);
+	if (order < 0 || order > MAX_ORDER) {
+		cprintf("order should be 0 - %d\n", MAX_ORDER);
+		return 0;
+	}
+
+	if (page_compact(&pp, order) < 0) {
+		cprintf("compaction failed\n");
+		return 0;
+	}
+	cprintf("free block at ppn %x, order %d\n", page2ppn(pp), order);
+	pages_free(pp, order);
+	return 0;
+}
+
+int mon_rmap(int argc, char **argv, struct Trapframe *tf)
+{
+	ppn_t ppn;
+
+	if (argc != 2) {
+		cprintf("usage: %s <ppn>\n", argv[0]);
+		return 0;
+	}
+
+	ppn = strtol(argv[1], NULL, 0);
+	if (ppn >= npage) {
+		cprintf("ppn should be less than %x\n", npage);
+		return 0;
+	}
+
+	rmap_info(ppn2page(ppn));
+	return 0;
+}
+
+int mon_vma(int argc, char **argv, struct Trapframe *tf)
+{
+	struct Env *e;
+
+	if (argc != 2) {
+		cprintf("usage: %s <envid>\n", argv[0]);
+		return 0;
+	}
+
+	if (envid2env(strtol(argv[1], NULL, 16), &e, 0) < 0) {
+		cprintf("no such environment\n");
+		return 0;
+	}
+
+	vma_info(e);
+	return 0;
+}
+
+int mon_top(int argc, char **argv, struct Trapframe *tf)
+{
+	env_cpu_info();
+	return 0;
+}
+
+int mon_pagecolor(int argc, char **argv, struct Trapframe *tf)
+{
+	if (argc == 2 && strcmp(argv[1], "on") == 0)
+		page_coloring = 1;
+	else if (argc == 2 && strcmp(argv[1], "off") == 0)
+		page_coloring = 0;
+	else if (argc != 1) {
+		cprintf("usage: %s [on|off]\n", argv[0]);
+		return 0;
+	}
+
+	cprintf("page coloring is %s, %d colors\n",
+		page_coloring ? "on" : "off", PAGE_COLORS);
+	return 0;
+}
+
 int mon_switch(int argc, char **argv, struct Trapframe *tf)
 {
 	int r;
@@ -21,6 +21,12 @@ int mon_freepage(int argc, char **argv, struct Trapframe *tf);
 int mon_dumpva(int argc, char **argv, struct Trapframe *tf);
 int mon_dumppa(int argc, char **argv, struct Trapframe *tf);
 int mon_buddyinfo(int argc, char **argv, struct Trapframe *tf);
+int mon_kmeminfo(int argc, char **argv, struct Trapframe *tf);
+int mon_compact(int argc, char **argv, struct Trapframe *tf);
+int mon_rmap(int argc, char **argv, struct Trapframe *tf);
+int mon_pagecolor(int argc, char **argv, struct Trapframe *tf);
+int mon_vma(int argc, char **argv, struct Trapframe *tf);
+int mon_top(int argc, char **argv, struct Trapframe *tf);
 int mon_switch(int argc, char **argv, struct Trapframe *tf);
 
 #endif	// !JOS_KERN_MONITOR_H
@@ -0,0 +1,211 @@
+/* See COPYRIGHT for copyright information. */
+
+#include <inc/types.h>
+#include <inc/string.h>
+#include <inc/memlayout.h>
+#include <inc/x86.h>
+#include <inc/mmu.h>
+#include <inc/assert.h>
+
+#include <kern/cpu.h>
+#include <kern/pmap.h>
+
+struct Cpu cpus[NCPU];
+int ncpu;
+struct Cpu *bootcpu = &cpus[0];
+physaddr_t lapicaddr;
+
+unsigned char percpu_kstacks[NCPU][KSTKSIZE]
+	__attribute__ ((aligned(PGSIZE)));
+
+// See the Intel MultiProcessor Specification, version 1.4, for the
+// layout of these tables ([MP x.y] refers to its sections).
+
+struct Mp {				// floating pointer [MP 4.1]
+	uint8_t signature[4];		// "_MP_"
+	physaddr_t physaddr;		// configuration table
+	uint8_t length;			// in 16 byte units, 1
+	uint8_t specrev;		// 1 or 4
+	uint8_t checksum;		// all bytes add up to 0
+	uint8_t type;			// default configuration, or 0
+	uint8_t imcrp;
+	uint8_t reserved[3];
+} __attribute__((__packed__));
+
+struct Mpconf {				// configuration table header [MP 4.2]
+	uint8_t signature[4];		// "PCMP"
+	uint16_t length;		// of the base table
+	uint8_t version;		// 1 or 4
+	uint8_t checksum;		// all bytes add up to 0
+	uint8_t product[20];
+	physaddr_t oemtable;
+	uint16_t oemlength;
+	uint16_t entry;			// number of entries
+	physaddr_t lapicaddr;		// local APIC base
+	uint16_t xlength;		// extended table length
+	uint8_t xchecksum;		// extended table checksum
+	uint8_t reserved;
+	uint8_t entries[0];
+} __attribute__((__packed__));
+
+struct Mpproc {				// processor entry [MP 4.3.1]
+	uint8_t type;			// MPPROC
+	uint8_t apicid;			// local APIC id
+	uint8_t version;		// local APIC version
+	uint8_t flags;			// MPPROC_*
+	uint8_t signature[4];
+	uint32_t feature;		// CPUID feature flags
+	uint8_t reserved[8];
+} __attribute__((__packed__));
+
+#define MPPROC_BOOT	0x02		// this is the boot CPU
+
+// Table entry types [MP 4.3]; all but processors are 8 bytes long
+#define MPPROC		0x00
+#define MPBUS		0x01
+#define MPIOAPIC	0x02
+#define MPIOINTR	0x03
+#define MPLINTR		0x04
+
+static uint8_t
+sum(void *addr, int len)
+{
+	uint8_t s = 0;
+	int i;
+
+	for (i = 0; i < len; i++)
+		s += ((uint8_t *) addr)[i];
+	return s;
+}
+
+// Look for an MP floating pointer in the 'len' bytes at 'pa'.
+static struct Mp *
+mp_search1(physaddr_t pa, size_t len)
+{
+	struct Mp *mp = KADDR(pa), *end = KADDR(pa + len);
+
+	for (; mp < end; mp++)
+		if (memcmp(mp->signature, "_MP_", 4) == 0 &&
+		    sum(mp, sizeof(*mp)) == 0)
+			return mp;
+	return NULL;
+}
+
+// The floating pointer is in the first KB of the EBDA, in the last KB
+// of base memory, or in the BIOS ROM [MP 4].
+static struct Mp *
+mp_search(void)
+{
+	uint8_t *bda = KADDR(0x400);
+	physaddr_t pa;
+	struct Mp *mp;
+
+	if ( (pa = *(uint16_t *) (bda + 0x0E) << 4)) {
+		if ( (mp = mp_search1(pa, 1024)))
+			return mp;
+	} else {
+		pa = *(uint16_t *) (bda + 0x13) * 1024;
+		if ( (mp = mp_search1(pa - 1024, 1024)))
+			return mp;
+	}
+	return mp_search1(0xF0000, 0x10000);
+}
+
+// Find the MP configuration table, and check it.
+// Stores the floating pointer in *pmp.
+static struct Mpconf *
+mp_config(struct Mp **pmp)
+{
+	struct Mpconf *conf;
+	struct Mp *mp;
+
+	if (!(mp = mp_search()))
+		return NULL;
+	*pmp = mp;
+	if (mp->physaddr == 0 || mp->type != 0) {
+		cprintf("SMP: default configurations not supported\n");
+		return NULL;
+	}
+	if (PPN(mp->physaddr) >= npage) {
+		cprintf("SMP: MP configuration table beyond memory\n");
+		return NULL;
+	}
+
+	conf = KADDR(mp->physaddr);
+	if (memcmp(conf->signature, "PCMP", 4) != 0 ||
+	    sum(conf, conf->length) != 0 ||
+	    (conf->version != 1 && conf->version != 4)) {
+		cprintf("SMP: bad MP configuration table\n");
+		return NULL;
+	}
+	return conf;
+}
+
+//
+// Find the CPUs and the local APIC base in the MP tables, and set up
+// cpus[] accordingly.  Without MP tables, there is just the boot CPU.
+//
+void
+mp_init(void)
+{
+	struct Mpconf *conf;
+	struct Mpproc *proc;
+	struct Mp *mp = NULL;
+	uint8_t *p;
+	int i;
+
+	for (i = 0; i < NCPU; i++)
+		cpus[i].cpu_id = i;
+
+	ncpu = 0;
+	if ( (conf = mp_config(&mp))) {
+		lapicaddr = conf->lapicaddr;
+		for (p = conf->entries, i = 0; i < conf->entry; i++) {
+			switch (*p) {
+			case MPPROC:
+				proc = (struct Mpproc *) p;
+				if (proc->flags & MPPROC_BOOT)
+					bootcpu = &cpus[ncpu];
+				if (ncpu < NCPU) {
+					cpus[ncpu].cpu_apicid = proc->apicid;
+					cpus[ncpu].cpu_status = CPU_HALTED;
+					ncpu++;
+				} else
+					cprintf("SMP: too many CPUs, "
+						"CPU %d disabled\n",
+						proc->apicid);
+				p += sizeof(struct Mpproc);
+				continue;
+			case MPBUS:
+			case MPIOAPIC:
+			case MPIOINTR:
+			case MPLINTR:
+				p += 8;
+				continue;
+			default:
+				cprintf("SMP: unknown MP entry type %x\n", *p);
+				ncpu = 0;
+				break;
+			}
+			break;
+		}
+	}
+
+	if (ncpu == 0) {
+		// no (usable) MP tables, a uniprocessor
+		ncpu = 1;
+		bootcpu = &cpus[0];
+		lapicaddr = 0;
+	}
+	bootcpu->cpu_status = CPU_STARTED;
+
+	cprintf("SMP: CPU %d found %d CPU(s)\n", bootcpu->cpu_id, ncpu);
+
+	if (lapicaddr && mp->imcrp) {
+		// [MP 3.2.6.1] The board starts in PIC mode, with the 8259s
+		// wired straight to the boot CPU.  Route them through the
+		// local APIC instead, whose LINT0 passes them on.
+		outb(0x22, 0x70);		// select the IMCR
+		outb(0x23, inb(0x23) | 1);	// mask external interrupts
+	}
+}
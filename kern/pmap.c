@@ -5,11 +5,16 @@
 #include <inc/error.h>
 #include <inc/string.h>
 #include <inc/assert.h>
+#include <inc/e820.h>
 
 #include <kern/pmap.h>
 #include <kern/kclock.h>
 #include <kern/env.h>
+#include <kern/cpu.h>
+#include <kern/picirq.h>
 #include <kern/buddy.h>
+#include <kern/rmap.h>
+#include <kern/vma.h>
 
 #define KDEBUG
 #include <kern/kdebug.h>
@@ -17,12 +22,44 @@
 
 // physical contiguous page freelist sized from 2^0 to 2^MAX_ORDER
 static struct Page_list page_free_list[MAX_ORDER + 1];
+// number of free blocks linked on each page_free_list[]
+static size_t nr_free[MAX_ORDER + 1];
+
+// LIFO cache of free order-0 pages sitting in front of the buddy lists.
+// It is refilled from, and drained to, page_free_list[0] PCP_BATCH pages
+// at a time, so alloc/free ping-pong never touches the buddy lists.
+#define PCP_SIZE	64
+#define PCP_BATCH	16
+static struct Page *page_magazine[PCP_SIZE];
+static int nr_magazine;
+static uint32_t magazine_hit, magazine_miss;
+
+// Pages cleared ahead of time by page_zero_idle(), handed out by
+// page_alloc_zeroed().  From the buddy system's point of view these
+// pages are allocated.
+#define ZPOOL_SIZE	64
+#define ZPOOL_BATCH	8
+static struct Page *page_zero_pool[ZPOOL_SIZE];
+static int nr_zero;
+static uint32_t zero_hit, zero_miss;
+
+// Free order-0 pages bucketed by cache color, for page_alloc_color().
+// The pool is refilled one naturally aligned block of PAGE_COLORS pages
+// at a time, which holds exactly one page of every color.  Pages freed
+// by their users go back through the magazine as usual.
+#define COLOR_ORDER	4		// PAGE_COLORS == 1 << COLOR_ORDER
+#define COLOR_POOL_MAX	(PAGE_COLORS * 8)
+bool page_coloring;
+static struct Page_list color_pool[PAGE_COLORS];
+static int nr_colored;
+static uint32_t color_hit, color_miss;
 
 // These variables are set by i386_detect_memory()
 static physaddr_t maxpa;	// Maximum physical address
 size_t npage;			// Amount of physical memory (in pages)
 static size_t basemem;		// Amount of base memory (in bytes)
 static size_t extmem;		// Amount of extended memory (in bytes)
+static struct E820_map e820;	// BIOS memory map, empty if unavailable
 
 // These variables are set in i386_vm_init()
 pde_t* boot_pgdir;		// Virtual address of boot time page directory
@@ -54,8 +91,8 @@ struct Segdesc gdt[] =
 	// 0x20 - user data segment
 	[GD_UD >> 3] = SEG(STA_W, 0x0, 0xffffffff, 3),
 
-	// 0x28 - tss, initialized in idt_init()
-	[GD_TSS >> 3] = SEG_NULL
+	// 0x28 - one tss per CPU, initialized in idt_init()
+	[(GD_TSS0 >> 3) + NCPU - 1] = SEG_NULL
 };
 
 struct Pseudodesc gdt_pd = {
@@ -68,19 +105,60 @@ nvram_read(int r)
 	return mc146818_read(r) | (mc146818_read(r + 1) << 8);
 }
 
+//
+// Copy the memory map left by the boot loader, and find the end of
+// usable memory in it.  Returns 0 if there is no map.
+//
+static physaddr_t
+e820_detect(void)
+{
+	struct E820_map *bios = (struct E820_map *) (KERNBASE + E820_MAP);
+	struct E820_entry *ep;
+	uint64_t end, top = 0;
+	int i;
+
+	if (bios->nr == 0 || bios->nr > E820_MAX)
+		return 0;
+	memmove(&e820, bios, sizeof(e820));
+
+	for (i = 0; i < e820.nr; i++) {
+		ep = &e820.map[i];
+		cprintf("  e820: [%08llx-%08llx] %s\n", ep->addr,
+			ep->addr + ep->len - 1,
+			ep->type == E820_RAM ? "usable" : "reserved");
+		if (ep->type != E820_RAM)
+			continue;
+		end = ep->addr + ep->len;
+		if (ep->addr == 0)
+			basemem = ROUNDDOWN(MIN(end, IOPHYSMEM), PGSIZE);
+		if (end > top)
+			top = end;
+	}
+
+	// only the memory remapped at KERNBASE is of any use to us
+	if (top > -KERNBASE)
+		top = -KERNBASE;
+	return ROUNDDOWN((physaddr_t) top, PGSIZE);
+}
+
 void
 i386_detect_memory(void)
 {
-	// CMOS tells us how many kilobytes there are
-	basemem = ROUNDDOWN(nvram_read(NVRAM_BASELO)*1024, PGSIZE);
-	extmem = ROUNDDOWN(nvram_read(NVRAM_EXTLO)*1024, PGSIZE);
-
-	// Calculate the maximum physical address based on whether
-	// or not there is any extended memory.  See comment in <inc/mmu.h>.
-	if (extmem)
-		maxpa = EXTPHYSMEM + extmem;
-	else
-		maxpa = basemem;
+	if ( (maxpa = e820_detect())) {
+		extmem = maxpa > EXTPHYSMEM ? maxpa - EXTPHYSMEM : 0;
+	} else {
+		// CMOS tells us how many kilobytes there are
+		basemem = ROUNDDOWN(nvram_read(NVRAM_BASELO)*1024, PGSIZE);
+		extmem = ROUNDDOWN(nvram_read(NVRAM_EXTLO)*1024, PGSIZE);
+
+		// Calculate the maximum physical address based on whether
+		// or not there is any extended memory.  See comment in
+		// <inc/mmu.h>.
+		if (extmem)
+			maxpa = EXTPHYSMEM + extmem;
+		else
+			maxpa = basemem;
+	}
 
 	npage = maxpa / PGSIZE;
 
@@ -184,6 +262,345 @@ boot_pgdir_walk(pde_t *pgdir, uintptr_t la, int create)
 	return 0;
 }
 
+//
+// Unmap everything the page table at pgdir[pdeno] maps and free it, or,
+// if other address spaces share it, just drop this one's use of it.
+//
+void
+pgtable_remove(pde_t *pgdir, uint32_t pdeno)
+{
+	struct Page *ptpp = pa2page(PTE_ADDR(pgdir[pdeno]));
+	pte_t *pt = page2kva(ptpp);
+	uint32_t pteno;
+
+	assert(pdeno < PDX(UTOP));
+	assert((pgdir[pdeno] & (PTE_P|PTE_PS)) == PTE_P);
+
+	// the mappings belong to the table, whoever uses it last
+	// removes them
+	if (ptpp->pp_ref == 1) {
+		for (pteno = 0; pteno < NPTENTRIES; pteno++)
+			if (pt[pteno] & PTE_P)
+				page_remove(pgdir, PGADDR(pdeno, pteno, 0));
+		pgdir[pdeno] = 0;
+	} else {
+		pgdir[pdeno] = 0;
+		tlb_flush(pgdir);
+	}
+	page_decref(ptpp);
+}
+
+// Pages collected by pgdir_teardown() before they are freed together.
+#define TEARDOWN_BATCH	64
+
+//
+// Unmap everything below UTOP in 'pgdir', which is about to be freed
+// and must not be loaded in CR3: page tables are scanned linearly, their
+// entries are not cleared and no TLB entry is invalidated, and the pages
+// losing their last reference are freed in batches.
+//
+void
+pgdir_teardown(pde_t *pgdir)
+{
+	struct Page *batch[TEARDOWN_BATCH], *ptpp, *pp;
+	uint32_t pdeno, pteno;
+	pte_t *pt;
+	int n = 0;
+
+	assert(rcr3() != PADDR(pgdir));
+
+	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
+		if (!(pgdir[pdeno] & PTE_P))
+			continue;
+
+		pp = pa2page(PTE_ADDR(pgdir[pdeno]));
+		if (pgdir[pdeno] & PTE_PS) {
+			rmap_del(pp, &pgdir[pdeno]);
+			if (--pp->pp_ref == 0)
+				pages_free(pp, SUPERPAGE_ORDER);
+			pgdir[pdeno] = 0;
+			continue;
+		}
+
+		// still in use by another address space (see pgdir_fork())
+		ptpp = pp;
+		pgdir[pdeno] = 0;
+		if (--ptpp->pp_ref)
+			continue;
+
+		pt = page2kva(ptpp);
+		for (pteno = 0; pteno < NPTENTRIES; pteno++) {
+			if (!(pt[pteno] & PTE_P))
+				continue;
+			pp = pa2page(PTE_ADDR(pt[pteno]));
+			rmap_del(pp, &pt[pteno]);
+			if (--pp->pp_ref)
+				continue;
+			batch[n++] = pp;
+			if (n == TEARDOWN_BATCH) {
+				pages_free_bulk(batch, n);
+				n = 0;
+			}
+		}
+
+		batch[n++] = ptpp;
+		if (n == TEARDOWN_BATCH) {
+			pages_free_bulk(batch, n);
+			n = 0;
+		}
+	}
+	pages_free_bulk(batch, n);
+}
+
+//
+// Free the page table covering 'va' in 'pgdir' if nothing is mapped
+// through it any more, or drop this address space's use of it if it is
+// shared.  page_remove() leaves empty tables in place, the unmap system
+// calls call this afterwards so that address spaces streaming through
+// memory do not keep a table for every 4MB they ever touched.
+//
+void
+pgtable_reclaim(pde_t *pgdir, void *va)
+{
+	pde_t *pde = &pgdir[PDX(va)];
+	struct Page *ptpp;
+
+	if ((uintptr_t) va >= UTOP || (*pde & (PTE_P|PTE_PS)) != PTE_P)
+		return;
+
+	ptpp = pa2page(PTE_ADDR(*pde));
+	if (ptpp->pp_nlive)
+		return;
+
+	DBG(C_VM, KDEBUG_FLOW, "free empty page table(ppn: 0x%x) at va "
+		"0x%08x [%x]\n", page2ppn(ptpp), PDX(va) * PTSIZE,
+		PADDR(pgdir));
+	*pde = 0;
+	page_decref(ptpp);
+	// invlpg drops the cached directory entries as well
+	tlb_invalidate(pgdir, va);
+}
+
+//
+// Give 'pgdir' a private copy of the page table covering 'va' if it
+// shares that table copy-on-write with other address spaces (see
+// pgdir_fork()).  Writable pages the table maps become copy-on-write
+// in both tables.
+//
+// RETURNS 
+//   0 -- on success, or if there is nothing to do
+//   -E_NO_MEM -- if out of memory
+//
+int
+pgtable_unshare(pde_t *pgdir, void *va)
+{
+	pde_t *pde = &pgdir[PDX(va)];
+	struct Page *ptpp, *newpp, *pp;
+	pte_t *pt, *newpt;
+	uint32_t i;
+	int r;
+
+	if ((*pde & (PTE_P|PTE_PS|PTE_COW)) != (PTE_P|PTE_COW))
+		return 0;
+
+	ptpp = pa2page(PTE_ADDR(*pde));
+	if (ptpp->pp_ref > 1) {
+		if ( (r = page_alloc_zeroed(&newpp)) < 0)
+			return r;
+		pt = page2kva(ptpp);
+		newpt = page2kva(newpp);
+
+		for (i = 0; i < NPTENTRIES; i++) {
+			if (!(pt[i] & PTE_P))
+				continue;
+			pp = pa2page(PTE_ADDR(pt[i]));
+			if ( (r = rmap_add(pp, &newpt[i],
+				PGADDR(PDX(va), i, 0))) < 0)
+				goto fail;
+			if (!(pt[i] & PTE_SHARE) && (pt[i] & (PTE_W|PTE_COW)))
+				pt[i] = (pt[i] & ~PTE_W) | PTE_COW;
+			newpt[i] = pt[i];
+			pp->pp_ref++;
+		}
+
+		newpp->pp_ref = 1;
+		newpp->pp_nlive = ptpp->pp_nlive;
+		ptpp->pp_ref--;
+		*pde = page2pa(newpp) | PGOFF(*pde);
+	}
+	*pde = (*pde & ~PTE_COW) | PTE_W;
+
+	// entries of the old table, still in use elsewhere, lost write
+	// permission too
+	lcr3(rcr3());
+	tlb_shootdown(NULL);
+	return 0;
+
+fail:
+	while (i-- > 0)
+		if (newpt[i] & PTE_P) {
+			pp = pa2page(PTE_ADDR(newpt[i]));
+			rmap_del(pp, &newpt[i]);
+			pp->pp_ref--;
+		}
+	page_free(newpp);
+	return r;
+}
+
+//
+// Share the user address space 'src' with 'dst', for fork.
+// Page tables are shared as a whole and write protected at the page
+// directory level: the first write into a 4MB region, from either side,
+// makes a private copy of its table (see pgtable_unshare()).  Writable
+// superpages become copy-on-write on both sides, unless PTE_SHARE.
+// The region holding the user stacks is copied right away instead, one
+// copy-on-write page at a time, leaving out the user exception stack:
+// it is written first thing anyway.
+//
+// RETURNS 
+//   0 -- on success
+//   -E_NO_MEM -- if out of memory, 'dst' is then partially filled
+//
+int
+pgdir_fork(pde_t *dst, pde_t *src)
+{
+	uint32_t pdeno, pteno;
+	uintptr_t va;
+	pte_t *pt;
+	int perm, r;
+
+	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
+		if (!(src[pdeno] & PTE_P))
+			continue;
+
+		if (src[pdeno] & PTE_PS) {
+			perm = src[pdeno] & PTE_USER;
+			if (!(perm & PTE_SHARE) && (perm & (PTE_W|PTE_COW))) {
+				perm = (perm & ~PTE_W) | PTE_COW;
+				src[pdeno] = PTE_ADDR(src[pdeno]) | perm | PTE_PS;
+			}
+			if ( (r = page_insert_large(dst,
+				pa2page(PTE_ADDR(src[pdeno])),
+				PGADDR(pdeno, 0, 0), perm)) < 0)
+				return r;
+			continue;
+		}
+
+		if (pdeno != PDX(UXSTACKTOP - PGSIZE)) {
+			src[pdeno] = (src[pdeno] & ~PTE_W) | PTE_COW;
+			dst[pdeno] = src[pdeno];
+			pa2page(PTE_ADDR(src[pdeno]))->pp_ref++;
+			continue;
+		}
+
+		if ( (r = pgtable_unshare(src, PGADDR(pdeno, 0, 0))) < 0)
+			return r;
+		pt = (pte_t *) KADDR(PTE_ADDR(src[pdeno]));
+		for (pteno = 0; pteno < NPTENTRIES; pteno++) {
+			va = (uintptr_t) PGADDR(pdeno, pteno, 0);
+			if (!(pt[pteno] & PTE_P) || va == UXSTACKTOP - PGSIZE)
+				continue;
+
+			perm = pt[pteno] & PTE_USER;
+			if (!(perm & PTE_SHARE) && (perm & (PTE_W|PTE_COW))) {
+				perm = (perm & ~PTE_W) | PTE_COW;
+				pt[pteno] = PTE_ADDR(pt[pteno]) | perm;
+			}
+			if ( (r = page_insert(dst, pa2page(PTE_ADDR(pt[pteno])),
+				(void *) va, perm)) < 0)
+				return r;
+		}
+	}
+
+	// 'src' lost write permissions, one flush covers them all
+	lcr3(rcr3());
+	tlb_shootdown(src);
+	return 0;
+}
+
+//
+// page_cow_fault() for the copy-on-write superpage mapped by 'pde',
+// at the 4MB aligned 'va'.
+//
+static int
+superpage_cow_fault(pde_t *pgdir, pde_t *pde, void *va)
+{
+	struct Page *pp, *copy;
+	int perm, r;
+
+	pp = pa2page(PTE_ADDR(*pde));
+	perm = ((*pde & PTE_USER) & ~PTE_COW) | PTE_W;
+
+	if (pp->pp_ref == 1) {
+		*pde = page2pa(pp) | perm | PTE_PS;
+		tlb_invalidate(pgdir, va);
+		return 0;
+	}
+
+	if ( (r = pages_alloc(&copy, SUPERPAGE_ORDER)) < 0)
+		return r;
+	memmove(page2kva(copy), page2kva(pp), PTSIZE);
+	if ( (r = page_insert_large(pgdir, copy, va, perm)) < 0) {
+		pages_free(copy, SUPERPAGE_ORDER);
+		return r;
+	}
+	return 0;
+}
+
+//
+// Resolve a write fault at 'va' on a copy-on-write page or page table:
+// give the address space a private copy of the table first, then a
+// private writable copy of the page, or simply make it writable if no
+// one else maps it any more.  A copy-on-write superpage is copied as
+// a whole.
+//
+// RETURNS 
+//   0 -- on success, the faulting access should be retried
+//   -E_INVAL -- if 'va' is not mapped copy-on-write
+//   -E_NO_MEM -- if out of memory
+//
+int
+page_cow_fault(pde_t *pgdir, void *va)
+{
+	struct Page *pp, *copy;
+	pte_t *pte;
+	int perm, r;
+	bool shared;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	if ((uintptr_t) va >= UTOP)
+		return -E_INVAL;
+
+	if ((pgdir[PDX(va)] & (PTE_P|PTE_PS|PTE_COW)) == (PTE_P|PTE_PS|PTE_COW))
+		return superpage_cow_fault(pgdir, &pgdir[PDX(va)],
+					   ROUNDDOWN(va, PTSIZE));
+
+	shared = (pgdir[PDX(va)] & (PTE_P|PTE_PS|PTE_COW)) == (PTE_P|PTE_COW);
+	if (shared && (r = pgtable_unshare(pgdir, va)) < 0)
+		return r;
+
+	if (!(pp = page_lookup(pgdir, va, &pte)) ||
+		(*pte & PTE_PS) || !(*pte & PTE_COW))
+		return shared ? 0 : -E_INVAL;
+
+	perm = ((*pte & PTE_USER) & ~PTE_COW) | PTE_W;
+
+	if (pp->pp_ref == 1) {
+		*pte = page2pa(pp) | perm;
+		tlb_invalidate(pgdir, va);
+		return 0;
+	}
+
+	if ( (r = page_alloc(&copy)) < 0)
+		return r;
+	memmove(page2kva(copy), page2kva(pp), PGSIZE);
+	if ( (r = page_insert(pgdir, copy, va, perm)) < 0) {
+		page_free(copy);
+		return r;
+	}
+	return 0;
+}
+
 //
 // Map [la, la+size) of linear address space to physical [pa, pa+size)
 // in the page table rooted at pgdir.  Size is a multiple of PGSIZE.
@@ -275,14 +692,23 @@ i386_vm_init(void)
 	pgdir[PDX(UVPT)] = PADDR(pgdir)|PTE_U|PTE_P;
 
 	//////////////////////////////////////////////////////////////////////
-	// Map the kernel stack (symbol name "bootstack").  The complete VA
-	// range of the stack, [KSTACKTOP-PTSIZE, KSTACKTOP), breaks into two
-	// pieces:
-	//     * [KSTACKTOP-KSTKSIZE, KSTACKTOP) -- backed by physical memory
-	//     * [KSTACKTOP-PTSIZE, KSTACKTOP-KSTKSIZE) -- not backed => faults
+	// Map the per-CPU kernel stacks (percpu_kstacks[]).  The VA range
+	// [KSTACKTOP-PTSIZE, KSTACKTOP) holds one stack per CPU, each
+	// breaking into two pieces:
+	//     * [CPU_KSTACKTOP(i)-KSTKSIZE, CPU_KSTACKTOP(i))
+	//		-- backed by physical memory
+	//     * [CPU_KSTACKTOP(i)-(KSTKSIZE+KSTKGAP), CPU_KSTACKTOP(i)-KSTKSIZE)
+	//		-- not backed => faults
 	//     Permissions: kernel RW, user NONE
-	boot_map_segment(pgdir, KSTACKTOP-KSTKSIZE, KSTKSIZE, 
-			PADDR(bootstack), PTE_W);
+	// The boot CPU runs on "bootstack" until its first trap.
+	// Everything above UTOP but VPT and UVPT is the same in every
+	// address space and mapped PTE_G, so those TLB entries survive the
+	// CR3 loads of env_run() once CR4_PGE is on.
+	// The bottom of that 4MB is for mmio_map_region().
+	static_assert(MMIOLIM <= CPU_KSTACKTOP(NCPU - 1) - KSTKSIZE - KSTKGAP);
+	for (i = 0; i < NCPU; i++)
+		boot_map_segment(pgdir, CPU_KSTACKTOP(i) - KSTKSIZE, KSTKSIZE,
+				PADDR(percpu_kstacks[i]), PTE_W|PTE_G);
 
 	//////////////////////////////////////////////////////////////////////
 	// Map all of physical memory at KERNBASE. 
@@ -297,7 +723,7 @@ i386_vm_init(void)
 	//   2) PSE(Page Size Extension) in CR4 is enabled.
 	paddr = 0x0;
 	for (i = PDX(KERNBASE); i <= PDX(MAXADDR); i++, paddr += PTSIZE)
-		pgdir[i] = paddr|PTE_W|PTE_P|PTE_PS;
+		pgdir[i] = paddr|PTE_W|PTE_P|PTE_PS|PTE_G;
 
 	//////////////////////////////////////////////////////////////////////
 	// Make 'pages' point to an array of size 'npage' of 'struct Page'.
@@ -317,7 +743,8 @@ i386_vm_init(void)
 	// would be freed at page_init();
 	memset(pages, 0xff, sizeof(struct Page) * npage);
 
-	boot_map_segment(pgdir, UPAGES, page_array_size, PADDR(pages), PTE_U);
+	boot_map_segment(pgdir, UPAGES, page_array_size, PADDR(pages),
+			PTE_U|PTE_G);
 
 	//////////////////////////////////////////////////////////////////////
 	// Make 'envs' point to an array of size 'NENV' of 'struct Env'.
@@ -329,7 +756,8 @@ i386_vm_init(void)
 	env_array_size = ROUNDUP(sizeof(struct Env) * NENV, PGSIZE);
 	envs = boot_alloc(env_array_size, PGSIZE);
 	memset(envs, 0x0, sizeof(struct Env) * NENV);
-	boot_map_segment(pgdir, UENVS, env_array_size, PADDR(envs), PTE_U);
+	boot_map_segment(pgdir, UENVS, env_array_size, PADDR(envs),
+			PTE_U|PTE_G);
 
 	// Check that the initial page directory has been set up correctly.
 	check_boot_pgdir();
@@ -350,7 +778,8 @@ i386_vm_init(void)
 
 	// Map VA 0:4MB same as VA KERNBASE, i.e. to PA 0:4MB.
 	// (Limits our kernel to <4MB)
-	pgdir[0] = pgdir[PDX(KERNBASE)];
+	// Not global, it has to go away with the next CR3 load.
+	pgdir[0] = pgdir[PDX(KERNBASE)] & ~PTE_G;
 
 	// Install page table.
 	lcr3(boot_cr3);
@@ -387,6 +816,12 @@ i386_vm_init(void)
 
 	// Flush the TLB for good measure, to kill the pgdir[0] mapping.
 	lcr3(boot_cr3);
+
+	// Enable global pages, only now that no global entry can be
+	// left over from the bootstrap mappings.
+	cr4 = rcr4();
+	cr4 |= CR4_PGE;
+	lcr4(cr4);
 }
 
 //
@@ -421,9 +856,15 @@ check_boot_pgdir(void)
 	for (i = 0; KERNBASE + i != 0; i += PTSIZE)
 		assert(check_va2pa(pgdir, KERNBASE + i) == i);
 
-	// check kernel stack
-	for (i = 0; i < KSTKSIZE; i += PGSIZE)
-		assert(check_va2pa(pgdir, KSTACKTOP - KSTKSIZE + i) == PADDR(bootstack) + i);
+	// check kernel stacks
+	for (n = 0; n < NCPU; n++) {
+		for (i = 0; i < KSTKSIZE; i += PGSIZE)
+			assert(check_va2pa(pgdir, CPU_KSTACKTOP(n) - KSTKSIZE + i)
+			       == PADDR(percpu_kstacks[n]) + i);
+		for (i = 0; i < KSTKGAP; i += PGSIZE)
+			assert(check_va2pa(pgdir, CPU_KSTACKTOP(n) - KSTKSIZE
+					   - KSTKGAP + i) == ~0);
+	}
 
 	// check for zero/non-zero in PDEs
 	for (i = 0; i < NPDENTRIES; i++) {
@@ -474,6 +915,44 @@ check_va2pa(pde_t *pgdir, uintptr_t va)
 // Pages are reference counted, and free pages are kept on a linked list.
 // --------------------------------------------------------------
 
+static void buddy_seed(ppn_t start, ppn_t end);
+
+//
+// Hand the usable pages in [start, end) to the buddy system, skipping
+// the holes the BIOS reported.  Returns the number of pages freed.
+//
+static int
+page_init_range(ppn_t start, ppn_t end)
+{
+	struct E820_entry *ep;
+	ppn_t lo, hi;
+	int i, n = 0;
+
+	if (!e820.nr) {
+		if (start < end) {
+			buddy_seed(start, end);
+			n = end - start;
+		}
+		return n;
+	}
+
+	for (i = 0; i < e820.nr; i++) {
+		ep = &e820.map[i];
+		// maxpa is below 4GB, so are the clipped ranges
+		if (ep->type != E820_RAM || ep->addr >= maxpa)
+			continue;
+		lo = PPN(ROUNDUP((physaddr_t) ep->addr, PGSIZE));
+		hi = PPN(MIN(ep->addr + ep->len, (uint64_t) maxpa));
+		lo = MAX(lo, start);
+		hi = MIN(hi, end);
+		if (lo < hi) {
+			buddy_seed(lo, hi);
+			n += hi - lo;
+		}
+	}
+	return n;
+}
+
 //  
 // Initialize page structure and memory free list.
 // After this point, ONLY use the functions below
@@ -497,21 +976,15 @@ page_init(void)
 	//
 	// Change the code to reflect this.
 	int i, npages = 0;
-	struct Page *pp = &pages[0];
-	for (i = 0; i < MAX_ORDER; i++)
+	for (i = 0; i <= MAX_ORDER; i++) {
 		LIST_INIT(&page_free_list[i]);
-
-#ifdef KDEBUG
-	k_debug_msg_off();
-#endif
-
-	// base useable memory
-	for (i = 1; i < PPN(basemem); i++) {
-		pages[i].pp_ref = 0;
-		page_free(&pages[i]);
-		npages++;
+		nr_free[i] = 0;
 	}
 
+	// base useable memory, but the page the APs start in
+	npages += page_init_range(1, PPN(MPENTRY_PADDR));
+	npages += page_init_range(PPN(MPENTRY_PADDR) + 1, PPN(basemem));
+
         //
         //    Current Physical Memory Layout:
         //
@@ -533,139 +1006,666 @@ page_init(void)
         //    +-----------------------+        <-- EXTPHYSMEM (eXtended memory)
 
 	boot_freemem = ROUNDUP(boot_freemem, PGSIZE);
-	for (i = PPN(PADDR(boot_freemem)); i < PPN(maxpa); i++) {
-		pages[i].pp_ref = 0;
-		page_free(&pages[i]);
-		npages++;
+	npages += page_init_range(PPN(PADDR(boot_freemem)), PPN(maxpa));
+
+	cprintf("Total usable memory: %d KB\n", npages * PGSIZE / 1024);
+}
+
+//
+// Initialize a Page structure.
+// The result has null links and 0 refcount.
+// Note that the corresponding physical page is NOT initialized!
+//
+static void
+page_initpp(struct Page *pp)
+{
+	memset(pp, 0, sizeof(*pp));
+}
+
+//
+// Link a free block onto page_free_list[order], tagging its head page.
+//
+static void
+buddy_insert(struct Page *pp, int order)
+{
+	PAGE_TAG_FREE(pp, order);
+	LIST_INSERT_HEAD(&page_free_list[order], pp, pp_link);
+	nr_free[order]++;
+}
+
+//
+// Unlink a free block from page_free_list[order] and drop its tag.
+//
+static void
+buddy_remove(struct Page *pp, int order)
+{
+	assert(PAGE_IS_FREE_HEAD(pp, order));
+	PAGE_UNTAG(pp);
+	LIST_REMOVE(pp, pp_link);
+	nr_free[order]--;
+}
+
+//
+// Allocates contiguous physical pages.
+// Does NOT set the contents of the physical page to zero -
+// the caller must do that if necessary.
+//
+// *pp_store -- is set to point to the Page struct of the newly allocated
+// page
+//
+// RETURNS 
+//   0 -- on success
+//   -E_NO_MEM -- otherwise 
+//
+// Hint: use LIST_FIRST, LIST_REMOVE, and page_initpp
+// Hint: pp_ref should not be incremented 
+static int
+buddy_alloc(struct Page **pp_store, int order)
+{
+	int i;
+	int cur_order = order;
+
+	assert(order <= MAX_ORDER);
+	assert(pp_store != 0);
+	DBG(C_MEM_ALLOC, KDEBUG_FLOW, " ---- allocating, order %d ----\n", order);
+
+	// We may run out of object of current order, borrow one from
+	// next order
+	while (order <= MAX_ORDER && !nr_free[order]) {
+		DBG(C_MEM_ALLOC, KDEBUG_VERBOSE, 
+			"borrow one object from order %d\n", order + 1);
+		order++;
+	}
+
+	if (order > MAX_ORDER) {
+		*pp_store = NULL;
+		return -E_NO_MEM;
+	}
+
+	*pp_store = LIST_FIRST(&page_free_list[order]);
+	buddy_remove(*pp_store, order);
+
+	// We borrowed one object from bigger order, but we don't need 
+	// such big object. Split the big one, and insert half info 
+	// previous order. Loop until the order we requested is reached.
+	while (cur_order < order) {
+		order--;
+		buddy_insert(BUDDY_OF(*pp_store, order), order);
+	}
+
+	for (i = 0; i < (1 << cur_order); i++) {
+		page_initpp(*pp_store + i);
+		PAGE_MARK_ALLOC(*pp_store + i);
+	}
+
+	return 0;
+}
+
+//
+// Return contiguous pages to the free list.
+// (This function should only be called when pp->pp_ref reaches 0.)
+//
+// Only the head page of a block is tagged, so each merge step costs a
+// single struct Page lookup no matter how large the buddy is.
+//
+static void
+buddy_free(struct Page *pp, int order)
+{
+	struct Page *buddy;
+
+	assert(pp->pp_ref == 0);
+	assert(order <= MAX_ORDER);
+
+	// sanity check:
+	// 1. PPN of freed page should be algined on (1 << order) boundary
+	// 2. the block should already be allocated 
+	assert((page2ppn(pp) & ((1 << order) - 1)) == 0);
+	assert(PAGE_ALLOCATED(pp));
+	PAGE_MARK_FREE(pp);
+
+	DBG(C_MEM_ALLOC, KDEBUG_FLOW, " ---- freeing ppn %x, order %d ----\n", 
+		page2ppn(pp), order);
+
+	while (order < MAX_ORDER)
+	{
+		buddy = BUDDY_OF(pp, order);
+
+		// try to merge if we can, the buddy must be the head of
+		// a free block of the very same order
+		if (page2ppn(buddy) + (1 << order) > npage ||
+			!PAGE_IS_FREE_HEAD(buddy, order))
+			break;
+
+		// we can merge the buddies
+		DBG(C_MEM_ALLOC, KDEBUG_VERBOSE, "merging ppn %x and its buddy %x\n", 
+			page2ppn(pp), page2ppn(buddy));
+		buddy_remove(buddy, order);
+		order++;
+		pp = (pp > buddy) ? buddy : pp;
+	}
+
+	DBG(C_MEM_ALLOC, KDEBUG_VERBOSE, "cannot merge, insert to order %d\n", order);
+	buddy_insert(pp, order);
+}
+
+//
+// Link the free pages [start, end) onto the buddy lists at boot, as the
+// largest naturally aligned blocks that fit.  Unlike freeing the pages
+// one by one, this never walks a merge chain, so it is linear in the
+// number of pages.  Neighbouring ranges are not merged with each other.
+//
+static void
+buddy_seed(ppn_t start, ppn_t end)
+{
+	ppn_t i;
+	int order;
+
+	for (i = start; i < end; i++)
+		page_initpp(&pages[i]);
+
+	while (start < end) {
+		order = MAX_ORDER;
+		while ((start & ((1 << order) - 1)) ||
+			start + (1 << order) > end)
+			order--;
+		buddy_insert(&pages[start], order);
+		start += 1 << order;
+	}
+}
+
+//
+// Move up to PCP_BATCH order-0 pages from the buddy lists into the
+// magazine.  Returns the number of pages moved.
+//
+static int
+magazine_refill(void)
+{
+	struct Page *pp;
+	int n = 0;
+
+	while (n < PCP_BATCH && nr_magazine < PCP_SIZE &&
+		buddy_alloc(&pp, 0) == 0) {
+		PAGE_MARK_FREE(pp);
+		page_magazine[nr_magazine++] = pp;
+		n++;
+	}
+	return n;
+}
+
+//
+// Give the 'n' oldest (coldest) pages of the magazine back to the buddy
+// lists, keeping the recently freed ones cached.
+//
+static void
+magazine_drain(int n)
+{
+	int i;
+
+	n = MIN(n, nr_magazine);
+	for (i = 0; i < n; i++) {
+		PAGE_MARK_ALLOC(page_magazine[i]);
+		buddy_free(page_magazine[i], 0);
+	}
+	nr_magazine -= n;
+	memmove(page_magazine, page_magazine + n,
+		nr_magazine * sizeof(page_magazine[0]));
+}
+
+//
+// Hand every page cached in the magazine and the zero pool back to the
+// buddy lists.  Returns the number of pages released.
+//
+static int color_drain(void);
+
+static int
+caches_drain(void)
+{
+	int n = nr_magazine + nr_zero + color_drain();
+
+	magazine_drain(nr_magazine);
+	while (nr_zero)
+		buddy_free(page_zero_pool[--nr_zero], 0);
+	return n;
+}
+
+//
+// Allocates 2^order contiguous physical pages, see buddy_alloc().
+// Order-0 requests are served from the page magazine.
+//
+int
+pages_alloc(struct Page **pp_store, int order)
+{
+	struct Page *pp;
+
+	assert(pp_store != 0);
+
+	if (order) {
+		if (buddy_alloc(pp_store, order) == 0)
+			return 0;
+
+		// pages cached in the magazine or the zero pool may be
+		// what keeps the buddies from coalescing, give them back
+		// and retry
+		if (caches_drain() && buddy_alloc(pp_store, order) == 0)
+			return 0;
+
+		// free memory is there but scattered, move user pages
+		// out of the way
+		return page_compact(pp_store, order);
+	}
+
+	if (nr_magazine)
+		magazine_hit++;
+	else {
+		magazine_miss++;
+		if (!magazine_refill() &&
+			!(color_drain() && magazine_refill())) {
+			// last resort, a pre-zeroed page is still a page
+			if (nr_zero) {
+				*pp_store = page_zero_pool[--nr_zero];
+				return 0;
+			}
+			*pp_store = NULL;
+			return -E_NO_MEM;
+		}
+	}
+
+	pp = page_magazine[--nr_magazine];
+	page_initpp(pp);
+	PAGE_MARK_ALLOC(pp);
+	*pp_store = pp;
+	return 0;
+}
+
+//
+// Frees 2^order contiguous physical pages, see buddy_free().
+// Order-0 pages are cached in the page magazine.
+//
+void
+pages_free(struct Page *pp, int order)
+{
+	if (order) {
+		buddy_free(pp, order);
+		return;
+	}
+
+	assert(pp->pp_ref == 0);
+	assert(PAGE_ALLOCATED(pp));
+
+	if (nr_magazine == PCP_SIZE)
+		magazine_drain(PCP_BATCH);
+
+	PAGE_MARK_FREE(pp);
+	page_magazine[nr_magazine++] = pp;
+}
+
+//
+// Free the 'n' order-0 pages of 'pps' at once, for teardowns.  The
+// magazine is topped up and the rest goes straight to the buddy lists,
+// instead of cycling each page through the magazine.
+//
+void
+pages_free_bulk(struct Page **pps, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		assert(pps[i]->pp_ref == 0);
+		assert(PAGE_ALLOCATED(pps[i]));
+
+		if (nr_magazine < PCP_SIZE) {
+			PAGE_MARK_FREE(pps[i]);
+			page_magazine[nr_magazine++] = pps[i];
+		} else
+			buddy_free(pps[i], 0);
+	}
+}
+
+//
+// Memory compaction.
+//
+// A block of 2^order pages can be made free if every page in it is
+// either free or movable.  A page is movable when all of its references
+// are 4KB user mappings recorded in its reverse map: its contents are
+// copied to a page outside the block and those PTEs are pointed at the
+// copy.  Anything else (page tables, page directories, superpages,
+// slabs, the kernel itself) pins the block.
+//
+// The kernel must not keep a bare struct Page pointer to a mapped page
+// across an allocation, or hold a reference of its own while it does
+// (page_insert() does the latter).
+//
+
+// Number of candidate blocks tried before giving up.
+#define COMPACT_TRIES	4
+
+// Per page of the block being compacted: the page it is being moved to.
+static struct Page *compact_dst[1 << MAX_ORDER];
+static uint32_t compact_ok, compact_fail, compact_moved;
+
+//
+// Can the in-use page 'pp' be moved?
+//
+static bool
+page_movable(struct Page *pp)
+{
+	struct Rmap *rm;
+
+	if (rmap_count(pp) != pp->pp_ref)
+		return 0;
+	LIST_FOREACH(rm, &pp->pp_rmap, rm_link)
+		if (rm->rm_va >= UTOP || *rm->rm_pte & PTE_PS)
+			return 0;
+	return 1;
+}
+
+//
+// Count the pages of the block at 'base' that have to be moved, or
+// return -1 if the block holds a page that can not be moved.
+// The cheap checks are always done, the reverse map is only looked at
+// with 'verify' set.
+//
+static int
+compact_scan(ppn_t base, int order, bool verify)
+{
+	ppn_t i = base, end = base + (1 << order);
+	struct Page *pp;
+	int used = 0;
+
+	while (i < end) {
+		pp = &pages[i];
+		if (PAGE_IS_FREE_ANY(pp)) {
+			i += 1 << PAGE_FREE_ORDER(pp);
+			continue;
+		}
+		// pages owned by the kernel carry no reference count,
+		// the ones reserved at boot have it set to ~0
+		if (!PAGE_ALLOCATED(pp) || pp->pp_ref == 0 ||
+			pp->pp_ref == (uint16_t) ~0)
+			return -1;
+		if (verify && !page_movable(pp))
+			return -1;
+		used++;
+		i++;
+	}
+	return used;
+}
+
+//
+// Pick the block of 2^order pages with the fewest pages to move,
+// skipping the ones listed in 'tried'.  Returns ~0 if there is none.
+//
+static ppn_t
+compact_pick(int order, ppn_t *tried, int ntried)
+{
+	ppn_t base, best = ~0;
+	int i, used, best_used = 1 << order;
+
+	for (base = 0; base + (1 << order) <= npage; base += 1 << order) {
+		for (i = 0; i < ntried; i++)
+			if (tried[i] == base)
+				break;
+		if (i < ntried)
+			continue;
+		used = compact_scan(base, order, 0);
+		if (used >= 0 && used < best_used) {
+			best = base;
+			best_used = used;
+		}
+	}
+	return best;
+}
+
+//
+// Take the free pieces of the block at 'base' off the buddy lists, so
+// the pages being moved out can not land in it.  Every page of the block
+// is then allocated: free ones with a zero refcount.
+//
+static void
+compact_isolate(ppn_t base, int order)
+{
+	ppn_t i = base, end = base + (1 << order);
+	struct Page *pp;
+	int j, o;
+
+	while (i < end) {
+		pp = &pages[i];
+		if (!PAGE_IS_FREE_ANY(pp)) {
+			i++;
+			continue;
+		}
+		o = PAGE_FREE_ORDER(pp);
+		buddy_remove(pp, o);
+		for (j = 0; j < (1 << o); j++) {
+			page_initpp(pp + j);
+			PAGE_MARK_ALLOC(pp + j);
+		}
+		i += 1 << o;
 	}
+}
 
-#ifdef KDEBUG
-	k_debug_msg_on();
-#endif
-	cprintf("Total usable memory: %d KB\n", npages * PGSIZE / 1024);
+//
+// Undo compact_isolate() for the pages of the block nobody references.
+//
+static void
+compact_release(ppn_t base, int order)
+{
+	ppn_t i;
+
+	for (i = base; i < base + (1 << order); i++)
+		if (pages[i].pp_ref == 0)
+			buddy_free(&pages[i], 0);
 }
 
 //
-// Initialize a Page structure.
-// The result has null links and 0 refcount.
-// Note that the corresponding physical page is NOT initialized!
+// Move the contents and the mappings of 'pp' to 'dst'.
 //
 static void
-page_initpp(struct Page *pp)
+page_migrate(struct Page *pp, struct Page *dst)
 {
-	memset(pp, 0, sizeof(*pp));
+	struct Rmap *rm;
+
+	memmove(page2kva(dst), page2kva(pp), PGSIZE);
+	LIST_FOREACH(rm, &pp->pp_rmap, rm_link) {
+		assert(PTE_ADDR(*rm->rm_pte) == page2pa(pp));
+		*rm->rm_pte = page2pa(dst) | PGOFF(*rm->rm_pte);
+	}
+	rmap_move(pp, dst);
+	dst->pp_ref = pp->pp_ref;
+	pp->pp_ref = 0;
 }
 
 //
-// Allocates contiguous physical pages.
-// Does NOT set the contents of the physical page to zero -
-// the caller must do that if necessary.
+// Empty the block at 'base', whose in-use pages have all been checked
+// to be movable.  Returns 0 on success, with every page of the block
+// allocated and unreferenced, or -E_NO_MEM if there is no room to move
+// the pages to, in which case nothing has been moved.
 //
-// *pp_store -- is set to point to the Page struct of the newly allocated
-// page
+static int
+compact_migrate(ppn_t base, int order)
+{
+	int i, n = 1 << order;
+
+	compact_isolate(base, order);
+
+	// get all destination pages first, so that failing leaves every
+	// mapping untouched
+	for (i = 0; i < n; i++) {
+		compact_dst[i] = NULL;
+		if (!pages[base + i].pp_ref)
+			continue;
+		if (page_alloc(&compact_dst[i]) < 0) {
+			while (i-- > 0)
+				if (compact_dst[i])
+					page_free(compact_dst[i]);
+			compact_release(base, order);
+			return -E_NO_MEM;
+		}
+	}
+
+	for (i = 0; i < n; i++)
+		if (compact_dst[i]) {
+			page_migrate(&pages[base + i], compact_dst[i]);
+			compact_moved++;
+		}
+
+	// the moved pages may be cached under any address space, the
+	// current one included
+	lcr3(rcr3());
+	tlb_shootdown(NULL);
+	return 0;
+}
+
+//
+// Build a free block of 2^order pages by moving user pages out of the
+// way, and allocate it as pages_alloc() would.
 //
 // RETURNS 
 //   0 -- on success
 //   -E_NO_MEM -- otherwise 
 //
-// Hint: use LIST_FIRST, LIST_REMOVE, and page_initpp
-// Hint: pp_ref should not be incremented 
 int
-pages_alloc(struct Page **pp_store, int order)
+page_compact(struct Page **pp_store, int order)
 {
-	int i;
-	int cur_order = order;
+	ppn_t tried[COMPACT_TRIES];
+	ppn_t base;
+	int i, ntried;
 
 	assert(order <= MAX_ORDER);
-	assert(pp_store != 0);
-	DBG(C_MEM_ALLOC, KDEBUG_FLOW, " ---- allocating, order %d ----\n", order);
-
-	*pp_store = LIST_FIRST(&page_free_list[order++]);
-	if (!*pp_store) 
-		// We ran out of object of current order, borrow one from next order
-		while (order <= MAX_ORDER)
-		{
-			DBG(C_MEM_ALLOC, KDEBUG_VERBOSE, 
-				"borrow one object from order %d\n", order);
-
-			*pp_store = LIST_FIRST(&page_free_list[order]);
-			if (!*pp_store) {
-				order++;
-				continue;
-			}
+	caches_drain();
+	if (buddy_alloc(pp_store, order) == 0)
+		return 0;
 
-			// We borrowed one object from bigger order, but we don't need 
-			// such big object. Split the big one, and insert half info 
-			// previous order. Loop until the order we requested is reached.
-			while (cur_order < order)
-			{
-				struct Page *buddy;		
+	for (ntried = 0; ntried < COMPACT_TRIES; ntried++) {
+		if ((base = compact_pick(order, tried, ntried)) == ~0)
+			break;
+		tried[ntried] = base;
+		if (compact_scan(base, order, 1) < 0)
+			continue;
 
-				LIST_REMOVE(*pp_store, pp_link);
-				order--;
-				buddy = BUDDY_OF(*pp_store, order);
-				LIST_INSERT_HEAD(&page_free_list[order], buddy, pp_link);
-			}
+		DBG(C_MEM_ALLOC, KDEBUG_FLOW,
+			"compacting order %d block at ppn %x\n", order, base);
+		if (compact_migrate(base, order) < 0)
 			break;
+
+		for (i = 0; i < (1 << order); i++) {
+			page_initpp(&pages[base + i]);
+			PAGE_MARK_ALLOC(&pages[base + i]);
 		}
-	else 
-		LIST_REMOVE(*pp_store, pp_link);
+		*pp_store = &pages[base];
+		compact_ok++;
+		return 0;
+	}
 
-	if (!*pp_store)
-		return -E_NO_MEM;
+	compact_fail++;
+	*pp_store = NULL;
+	return -E_NO_MEM;
+}
 
-	for (i = 0; i < (1 << cur_order); i++) {
-		page_initpp(*pp_store + i);
-		PAGE_MARK_ALLOC(*pp_store + i);
+//
+// Allocate an order-0 page whose contents are already zero.
+// Pages come from the pool filled by page_zero_idle(); when the pool is
+// empty the page is cleared here, on the caller's time.
+//
+// RETURNS 
+//   0 -- on success
+//   -E_NO_MEM -- otherwise 
+//
+int
+page_alloc_zeroed(struct Page **pp_store)
+{
+	int r;
+
+	if (nr_zero) {
+		zero_hit++;
+		*pp_store = page_zero_pool[--nr_zero];
+		return 0;
 	}
 
+	zero_miss++;
+	if ( (r = page_alloc(pp_store)) < 0)
+		return r;
+	memset(page2kva(*pp_store), 0, PGSIZE);
 	return 0;
 }
 
 //
-// Return contiguous pages to the free list.
-// (This function should only be called when pp->pp_ref reaches 0.)
+// Called when nothing is runnable:
+// clear up to ZPOOL_BATCH free pages into the zero pool, so that
+// page_alloc_zeroed() does not have to.
 //
 void
-pages_free(struct Page *pp, int order)
+page_zero_idle(void)
 {
-	int i;
-	struct Page *buddy;
-
-	assert(pp->pp_ref == 0);
+	struct Page *pp;
+	int n;
 
-	// sanity check:
-	// 1. PPN of freed page should be algined on (1 << order) boundary
-	// 2. each page should already be allocated 
-	assert((page2ppn(pp) & ((1 << order) - 1)) == 0);
-	for (i = 0; i < (1 << order); i++) {
-		assert(PAGE_ALLOCATED(pp + i));
-		PAGE_MARK_FREE(pp + i);
+	for (n = 0; n < ZPOOL_BATCH && nr_zero < ZPOOL_SIZE; n++) {
+		if (page_alloc(&pp) < 0)
+			break;
+		memset(page2kva(pp), 0, PGSIZE);
+		page_zero_pool[nr_zero++] = pp;
 	}
+}
 
-	assert(order <= MAX_ORDER);
-	DBG(C_MEM_ALLOC, KDEBUG_FLOW, " ---- freeing ppn %x, order %d ----\n", 
-		page2ppn(pp), order);
+//
+// Give every page of the color pool back to the buddy lists.
+// Returns the number of pages released.
+//
+static int
+color_drain(void)
+{
+	struct Page *pp;
+	int c, n = nr_colored;
+
+	for (c = 0; c < PAGE_COLORS; c++)
+		while ( (pp = LIST_FIRST(&color_pool[c]))) {
+			LIST_REMOVE(pp, pp_link);
+			PAGE_MARK_ALLOC(pp);
+			buddy_free(pp, 0);
+		}
+	nr_colored = 0;
+	return n;
+}
 
-	while (order < MAX_ORDER)
-	{
-		buddy = BUDDY_OF(pp, order);
-		
-		// try to merge if we can
-		for (i = 0; i < (1 << order); i++) 
-			if (PAGE_ALLOCATED(buddy + i))
-				goto cannot_merge;
+//
+// Allocate an order-0 page of cache color 'color' (modulo PAGE_COLORS),
+// so that pages with different colors never compete for the same cache
+// sets.  If no block can be carved into colors, any page is returned.
+//
+// RETURNS 
+//   0 -- on success
+//   -E_NO_MEM -- otherwise 
+//
+int
+page_alloc_color(struct Page **pp_store, int color)
+{
+	struct Page *pp;
+	int i;
 
-		// we can merge the buddies
-		order++;
-		DBG(C_MEM_ALLOC, KDEBUG_VERBOSE, "merging ppn %x and its buddy %x\n", 
-			page2ppn(pp), page2ppn(buddy));
-		LIST_REMOVE(buddy, pp_link);
-		pp = (pp > buddy) ? buddy : pp;
+	color &= PAGE_COLORS - 1;
+	if (!LIST_EMPTY(&color_pool[color]))
+		color_hit++;
+	else {
+		color_miss++;
+		// pages of the colors nobody asks for pile up, start over
+		if (nr_colored >= COLOR_POOL_MAX)
+			color_drain();
+		if (buddy_alloc(&pp, COLOR_ORDER) < 0)
+			return page_alloc(pp_store);
+		for (i = 0; i < PAGE_COLORS; i++)
+			LIST_INSERT_HEAD(&color_pool[page_color(pp + i)],
+					 pp + i, pp_link);
+		nr_colored += PAGE_COLORS;
 	}
-cannot_merge:
-	DBG(C_MEM_ALLOC, KDEBUG_VERBOSE, "cannot merge, insert to order %d\n", order);
-	LIST_INSERT_HEAD(&page_free_list[order], pp, pp_link);
+
+	pp = LIST_FIRST(&color_pool[color]);
+	LIST_REMOVE(pp, pp_link);
+	nr_colored--;
+	page_initpp(pp);
+	PAGE_MARK_ALLOC(pp);
+	*pp_store = pp;
+	return 0;
 }
 
 inline int 
@@ -685,23 +1685,23 @@ get_order(unsigned long size)
 void
 buddy_info(void)
 {
-	int order = 0;
+	int order;
 	int npages = 0;
 
-	while (order <= MAX_ORDER)
-	{
-		int num = 0;
-		struct Page *pp= LIST_FIRST(&page_free_list[order]);
-		cprintf("Number of free pages on order %02d: ", order);
-
-		while (pp) {
-			num++;
-			pp = LIST_NEXT(pp, pp_link);
-		}
-		cprintf("%d\n", num);
-		npages += ((1 << order) * num);
-		order++;
+	for (order = 0; order <= MAX_ORDER; order++) {
+		cprintf("Number of free pages on order %02d: %d\n",
+			order, nr_free[order]);
+		npages += (1 << order) * nr_free[order];
 	}
+	cprintf("Order-0 magazine: %d pages cached, %u hits, %u misses\n",
+		nr_magazine, magazine_hit, magazine_miss);
+	cprintf("Zero pool: %d pages cached, %u hits, %u misses\n",
+		nr_zero, zero_hit, zero_miss);
+	cprintf("Color pool (%s): %d pages cached, %u hits, %u misses\n",
+		page_coloring ? "on" : "off", nr_colored, color_hit, color_miss);
+	cprintf("Compaction: %u succeeded, %u failed, %u pages moved\n",
+		compact_ok, compact_fail, compact_moved);
+	npages += nr_magazine + nr_zero + nr_colored;
 	cprintf("Avalible memory: %d KB\n", npages * PGSIZE / 1024);
 }
 
@@ -728,6 +1728,7 @@ page_decref(struct Page* pp)
 //    - If the request address is in Remapped Physical Memory
 //      (addr > KERNBASE, which has PS flag set to reduce memory consumption)
 //      return corresponding page directory entry.
+//    - The same goes for user superpages, see page_insert_large().
 //
 // This is boot_pgdir_walk, but using page_alloc() instead of boot_alloc().
 // Unlike boot_pgdir_walk, pgdir_walk can fail.
@@ -752,21 +1753,24 @@ pgdir_walk(pde_t *pgdir, const void *va, int create)
 		return (pte_t *)pde;
 	}
 
+	if (*pde & PTE_PS)
+		return (pte_t *)pde;
+
 	if (*pde & PTE_P)
 		return (pte_t *)KADDR(PTE_ADDR(*pde)) + PTX(va);
 	else
 		if (create) {
 			physaddr_t p;
 
-			if (page_alloc(&new) == -E_NO_MEM)
+			if (page_alloc_zeroed(&new) == -E_NO_MEM)
 				goto pgdir_walk_fail;
 
 			DBG(C_VM, KDEBUG_FLOW,
 				"create new page table(ppn: 0x%x) at va 0x%08x [%x]\n",
 				page2ppn(new), PDX(va) * PTSIZE, PADDR(pgdir));
-			memset(page2kva(new), 0, PGSIZE);
 
 			new->pp_ref++;
+			new->pp_nlive = 0;
 
 			// enalbe all permissions, to let next level page table
 			// control permission accordingly.
@@ -801,8 +1805,8 @@ pgdir_walk_fail:
 int
 page_insert(pde_t *pgdir, struct Page *pp, void *va, int perm) 
 {
-	int ret = 0;
 	pte_t *pte;
+	int r;
 
 	// If PTE_PS is used for physical memory remapping, this function
 	// can not be called with va >= KERNBASE, since two level page
@@ -813,28 +1817,76 @@ page_insert(pde_t *pgdir, struct Page *pp, void *va, int perm)
 	if (pp == NULL)
 		return -E_INVAL;
 
-	// get the page, to prevent it to be freed at
-	// next page_remove() call
+	if ( (r = pgtable_unshare(pgdir, va)) < 0)
+		return r;
+
+	// get the page, to prevent it to be freed at next page_remove()
+	// call, or moved by page_compact() while a page table is being
+	// allocated.  The reference becomes the one of the new mapping.
 	pp->pp_ref++;
 
 	// remove previous mapping, if exist
 	page_remove(pgdir, va);
 
-	pp->pp_ref--;
-
 	DBG(C_VM, KDEBUG_FLOW,
 		"insert a page(ppn: 0x%x) onto va 0x%08x [%x]\n",
 		page2ppn(pp), va, PADDR(pgdir));
 
-	if ( (pte = pgdir_walk(pgdir, va, 1))) {
+	if (!(pte = pgdir_walk(pgdir, va, 1)) ||
+		rmap_add(pp, pte, ROUNDDOWN(va, PGSIZE)) < 0) {
+		// page_alloc() or the reverse map ran out of memory
+		pp->pp_ref--;
+		pgtable_reclaim(pgdir, va);
+		return -E_NO_MEM;
+	}
+	*pte = page2pa(pp)|perm|PTE_P;
+	pa2page(PTE_ADDR(pgdir[PDX(va)]))->pp_nlive++;
+
+	return 0;
+}
 
-		pp->pp_ref++;
-		*pte = page2pa(pp)|perm|PTE_P;
-	} else
-		// pgdir_walk failed when page_alloc() returned -E_NO_MEM
-		ret = -E_NO_MEM;
+//
+// Map the 2^SUPERPAGE_ORDER pages block headed by 'pp' at the 4MB aligned
+// virtual address 'va' with a single PTE_PS page directory entry.
+// Whatever was mapped in [va, va+PTSIZE) before is removed, including
+// the page table, if any.
+//
+// The whole superpage is reference counted on its head page.
+//
+// RETURNS: 
+//   0 on success
+//   -E_INVAL, if invalid argument given
+//
+int
+page_insert_large(pde_t *pgdir, struct Page *pp, void *va, int perm)
+{
+	pde_t *pde = &pgdir[PDX(va)];
+
+	assert((uintptr_t)va < KERNBASE);
+
+	if (pp == NULL || (uintptr_t)va & (PTSIZE - 1) ||
+		page2ppn(pp) & ((1 << SUPERPAGE_ORDER) - 1))
+		return -E_INVAL;
+
+	// hold a reference, so mapping a superpage over itself is a no-op
+	pp->pp_ref++;
 
-	return ret;
+	if (*pde & PTE_PS)
+		page_remove(pgdir, va);
+	else if (*pde & PTE_P)
+		pgtable_remove(pgdir, PDX(va));
+
+	DBG(C_VM, KDEBUG_FLOW,
+		"insert a superpage(ppn: 0x%x) onto va 0x%08x [%x]\n",
+		page2ppn(pp), va, PADDR(pgdir));
+
+	if (rmap_add(pp, pde, va) < 0) {
+		pp->pp_ref--;
+		return -E_NO_MEM;
+	}
+	*pde = page2pa(pp)|perm|PTE_PS|PTE_P;
+	tlb_invalidate(pgdir, va);
+	return 0;
 }
 
 //
@@ -843,6 +1895,9 @@ page_insert(pde_t *pgdir, struct Page *pp, void *va, int perm)
 // of the pte for this page.  This is used by page_remove
 // but should not be used by other callers.
 //
+// For a superpage this is the head page of the whole 4MB block, and
+// *pte_store points to the page directory entry.
+//
 // Return 0 if there is no page mapped at va.
 //
 // Hint: the TA solution uses pgdir_walk and pa2page.
@@ -881,6 +1936,7 @@ page_lookup(pde_t *pgdir, void *va, pte_t **pte_store)
 //     (if such a PTE exists)
 //   - The TLB must be invalidated if you remove an entry from
 //     the pg dir/pg table.
+//   - If 'va' lies in a superpage, the whole 4MB mapping is removed.
 //
 // Hint: The TA solution is implemented using page_lookup,
 // 	tlb_invalidate, and page_decref.
@@ -890,13 +1946,27 @@ page_remove(pde_t *pgdir, void *va)
 {
 	struct Page *target;
 	pte_t *pte;
+	int r;
+
+	// callers able to fail should have unshared the table already
+	if ( (r = pgtable_unshare(pgdir, va)) < 0)
+		panic("page_remove: %e", r);
 
 	target = page_lookup(pgdir, va, &pte);
 	if (target) {
 		DBG(C_VM, KDEBUG_FLOW,
 			"remove a page(ppn: 0x%x) from va 0x%08x [%x]\n",
 			page2ppn(target), va, PADDR(pgdir));
-		page_decref(target);
+		if (*pte & PTE_PS) {
+			va = ROUNDDOWN(va, PTSIZE);
+			rmap_del(target, pte);
+			if (--target->pp_ref == 0)
+				pages_free(target, SUPERPAGE_ORDER);
+		} else {
+			rmap_del(target, pte);
+			page_decref(target);
+			pa2page(PTE_ADDR(pgdir[PDX(va)]))->pp_nlive--;
+		}
 		if (*pte)
 			*pte = 0; // clear the mapping
 		tlb_invalidate(pgdir, va);
@@ -905,6 +1975,178 @@ page_remove(pde_t *pgdir, void *va)
 	//current va is not backed with a page, do nothing
 }
 
+// Range operations touching more pages than this reload CR3 once
+// instead of invalidating the TLB entries one by one.
+#define TLB_FLUSH_PAGES	32
+
+//
+// Check that [start, end) does not cover part of a superpage only, and,
+// if 'perm' asks for PTE_W, that no read-only page is mapped there.
+//
+static int
+range_check(pde_t *pgdir, uintptr_t start, uintptr_t end, int perm)
+{
+	uintptr_t va;
+	pde_t pde;
+	pte_t *pte;
+
+	for (va = start; va < end; va += PGSIZE) {
+		pde = pgdir[PDX(va)];
+		if (!(pde & PTE_P)) {
+			va = ROUNDDOWN(va, PTSIZE) + PTSIZE - PGSIZE;
+			continue;
+		}
+		if (pde & PTE_PS) {
+			if ((va & (PTSIZE - 1)) || end - va < PTSIZE)
+				return -E_INVAL;
+			if ((perm & PTE_W) && !(pde & (PTE_W|PTE_COW)))
+				return -E_INVAL;
+			va += PTSIZE - PGSIZE;
+			continue;
+		}
+		pte = (pte_t *) KADDR(PTE_ADDR(pde)) + PTX(va);
+		if ((*pte & PTE_P) && (perm & PTE_W) &&
+			!(*pte & (PTE_W|PTE_COW)))
+			return -E_INVAL;
+	}
+	return 0;
+}
+
+//
+// Unmap every page in [start, end) of 'pgdir', both page-aligned.
+// Superpages must be covered entirely.  A page table shared with other
+// address spaces that the range covers entirely is just let go of.
+//
+// RETURNS 
+//   0 -- on success
+//   -E_INVAL -- if the range covers part of a superpage
+//   -E_NO_MEM -- if a shared page table could not be copied, the range
+//     is then partially unmapped
+//
+int
+page_remove_range(pde_t *pgdir, uintptr_t start, uintptr_t end)
+{
+	bool flush_all = (end - start) / PGSIZE > TLB_FLUSH_PAGES;
+	struct Page *pp;
+	uintptr_t va, next;
+	pde_t *pde;
+	pte_t *pte;
+	int r;
+
+	assert(PGOFF(start) == 0 && PGOFF(end) == 0 && end <= UTOP);
+	if ( (r = range_check(pgdir, start, end, 0)) < 0)
+		return r;
+
+	for (va = start; va < end; va = next) {
+		next = MIN(ROUNDDOWN(va, PTSIZE) + PTSIZE, end);
+		pde = &pgdir[PDX(va)];
+		if (!(*pde & PTE_P))
+			continue;
+		if (*pde & PTE_PS) {
+			page_remove(pgdir, (void *) va);
+			continue;
+		}
+
+		pp = pa2page(PTE_ADDR(*pde));
+		if ((*pde & PTE_COW) && pp->pp_ref > 1 &&
+			next - va == PTSIZE) {
+			// covers 1024 pages, the flush is done at the end
+			*pde = 0;
+			page_decref(pp);
+			continue;
+		}
+		if ( (r = pgtable_unshare(pgdir, (void *) va)) < 0)
+			goto out;
+
+		pte = (pte_t *) KADDR(PTE_ADDR(*pde)) + PTX(va);
+		for (; va < next; va += PGSIZE, pte++) {
+			if (!(*pte & PTE_P))
+				continue;
+			pp = pa2page(PTE_ADDR(*pte));
+			rmap_del(pp, pte);
+			page_decref(pp);
+			pa2page(PTE_ADDR(*pde))->pp_nlive--;
+			*pte = 0;
+			if (!flush_all)
+				tlb_invalidate(pgdir, (void *) va);
+		}
+		pgtable_reclaim(pgdir, (void *) (next - PGSIZE));
+	}
+	r = 0;
+
+out:
+	if (flush_all)
+		tlb_flush(pgdir);
+	return r;
+}
+
+//
+// Change the permissions of every page mapped in [start, end) of
+// 'pgdir' to 'perm', like sys_page_map() would.  Copy-on-write pages
+// and superpages asked to be writable stay copy-on-write.  Unmapped
+// pages are skipped.
+//
+// RETURNS 
+//   0 -- on success
+//   -E_INVAL -- if the range covers part of a superpage, or 'perm' asks
+//     for PTE_W and a read-only page is mapped in the range
+//   -E_NO_MEM -- if a shared page table could not be copied, the range
+//     is then partially changed
+//
+int
+page_protect_range(pde_t *pgdir, uintptr_t start, uintptr_t end, int perm)
+{
+	bool flush_all = (end - start) / PGSIZE > TLB_FLUSH_PAGES;
+	uintptr_t va, next;
+	pde_t *pde;
+	pte_t *pte, npte;
+	int r;
+
+	assert(PGOFF(start) == 0 && PGOFF(end) == 0 && end <= UTOP);
+	if ( (r = range_check(pgdir, start, end, perm)) < 0)
+		return r;
+
+	for (va = start; va < end; va = next) {
+		next = MIN(ROUNDDOWN(va, PTSIZE) + PTSIZE, end);
+		pde = &pgdir[PDX(va)];
+		if (!(*pde & PTE_P))
+			continue;
+		if (*pde & PTE_PS) {
+			if ((*pde & PTE_COW) && (perm & PTE_W))
+				*pde = PTE_ADDR(*pde) | (perm & ~PTE_W) |
+					PTE_COW | PTE_PS;
+			else
+				*pde = PTE_ADDR(*pde) | perm | PTE_PS;
+			if (!flush_all)
+				tlb_invalidate(pgdir, (void *) va);
+			continue;
+		}
+		if ( (r = pgtable_unshare(pgdir, (void *) va)) < 0)
+			goto out;
+
+		pte = (pte_t *) KADDR(PTE_ADDR(*pde)) + PTX(va);
+		for (; va < next; va += PGSIZE, pte++) {
+			if (!(*pte & PTE_P))
+				continue;
+			if ((*pte & PTE_COW) && (perm & PTE_W))
+				npte = PTE_ADDR(*pte) | (perm & ~PTE_W) | PTE_COW;
+			else
+				npte = PTE_ADDR(*pte) | perm;
+			if (npte == *pte)
+				continue;
+			*pte = npte;
+			if (!flush_all)
+				tlb_invalidate(pgdir, (void *) va);
+		}
+	}
+	r = 0;
+
+out:
+	if (flush_all)
+		tlb_flush(pgdir);
+	return r;
+}
+
 //
 // Map [la, la+size) of linear address space to physical [pa, pa+size)
 // in the page table rooted at pgdir. Previous mapping will be removed.
@@ -935,13 +2177,138 @@ page_map_segment(pde_t *pgdir, struct Page *pp, void *va, size_t size, int perm)
 //
 // Invalidate a TLB entry, but only if the page tables being
 // edited are the ones currently in use by the processor.
+// The other CPUs using them get a shootdown.
 //
 void
 tlb_invalidate(pde_t *pgdir, void *va)
 {
-	// Flush the entry only if we're modifying the current address space.
-	if (!curenv || curenv->env_pgdir == pgdir)
+	// Flush the entry only if we're modifying the current address space,
+	// or if it is a global one above UTOP, shared by all of them.
+	if (!curenv || curenv->env_pgdir == pgdir || (uintptr_t) va >= UTOP)
 		invlpg(va);
+	tlb_shootdown((uintptr_t) va >= UTOP ? NULL : pgdir);
+}
+
+//
+// Flush the whole TLB, if 'pgdir' is the current address space.
+// Global entries stay, see tlb_flush_global().
+//
+void
+tlb_flush(pde_t *pgdir)
+{
+	if (!curenv || curenv->env_pgdir == pgdir)
+		lcr3(rcr3());
+	tlb_shootdown(pgdir);
+}
+
+//
+// Flush the whole TLB, global entries included, for the rare changes
+// to several kernel mappings at once.  Toggling CR4_PGE does it.
+//
+void
+tlb_flush_global(void)
+{
+	uint32_t cr4 = rcr4();
+
+	if (cr4 & CR4_PGE) {
+		lcr4(cr4 & ~CR4_PGE);
+		lcr4(cr4);
+	} else
+		lcr3(rcr3());
+}
+
+// Number of the last TLB shootdown.  Each CPU's cpu_tlb_gen tells the
+// last one it caught up with.
+static volatile uint32_t tlb_gen;
+
+// Whether CPU 'c' may cache entries of 'pgdir', see tlb_shootdown().
+static bool
+tlb_shootdown_target(struct Cpu *c, pde_t *pgdir)
+{
+	return c != thiscpu && c->cpu_env &&
+		(!pgdir || c->cpu_env->env_pgdir == pgdir);
+}
+
+//
+// Make the other CPUs drop what their TLBs cache of 'pgdir', or of
+// every address space if 'pgdir' is NULL, once the caller changed its
+// mappings and took care of the TLB of this CPU.
+//
+// Only CPUs with an environment to run can cache user mappings.  Each
+// gets an IRQ_TLB, and we wait for those in user mode to flush.  Those
+// in the kernel wait for the kernel lock, which we hold, and catch up
+// in tlb_sync() once they get it, before they touch user memory; the
+// interrupt stays pending until they return to user mode, where it
+// finds nothing left to do.  We cannot wait for them instead, they
+// take no interrupt while they wait.
+//
+void
+tlb_shootdown(pde_t *pgdir)
+{
+	struct Cpu *c;
+	bool sent = 0;
+
+	for (c = cpus; c < cpus + ncpu; c++)
+		if (tlb_shootdown_target(c, pgdir)) {
+			if (!sent)
+				tlb_gen++;
+			sent = 1;
+			lapic_ipi(c->cpu_apicid, IRQ_OFFSET + IRQ_TLB);
+		}
+	if (!sent)
+		return;
+
+	for (c = cpus; c < cpus + ncpu; c++)
+		if (tlb_shootdown_target(c, pgdir))
+			while (c->cpu_in_user && c->cpu_tlb_gen != tlb_gen)
+				asm volatile("pause");
+}
+
+//
+// Flush the TLB of this CPU if it missed a shootdown.  Called when
+// taking the kernel lock from user mode, and on IRQ_TLB.
+//
+void
+tlb_sync(void)
+{
+	uint32_t gen = tlb_gen;
+
+	if (thiscpu->cpu_tlb_gen != gen) {
+		tlb_flush_global();
+		thiscpu->cpu_tlb_gen = gen;
+	}
+}
+
+//
+// Map the 'size' bytes of device memory at physical address 'pa' into
+// [MMIOBASE, MMIOLIM), uncached, the same in every address space.
+// Returns the virtual address of 'pa'.
+//
+// Panics when the region is full; it is meant for the few devices set
+// up at boot.
+//
+void *
+mmio_map_region(physaddr_t pa, size_t size)
+{
+	static uintptr_t base = MMIOBASE;
+	uintptr_t va = base + PGOFF(pa);
+	size_t off;
+	pte_t *pte;
+
+	size = ROUNDUP(size + PGOFF(pa), PGSIZE);
+	pa = ROUNDDOWN(pa, PGSIZE);
+	if (size > MMIOLIM - base)
+		panic("mmio_map_region: out of MMIO space");
+
+	// the kernel stacks' page table covers the region, and every
+	// address space shares it
+	for (off = 0; off < size; off += PGSIZE) {
+		pte = pgdir_walk(boot_pgdir, (void *) (base + off), 0);
+		assert(pte && !(*pte & PTE_P));
+		*pte = (pa + off)|PTE_PCD|PTE_PWT|PTE_W|PTE_G|PTE_P;
+	}
+	base += size;
+	return (void *) va;
 }
 
 static uintptr_t user_mem_check_addr;
@@ -978,11 +2345,30 @@ user_mem_check(struct Env *env, const void *va, size_t len, int perm)
 
 	while (va < end) {
 		pte_t *p;
+		int eff;
+
+		// demand-zero pages the kernel is asked to touch are
+		// populated now, so the check passes
+		if ( (!(p = pgdir_walk(curenv->env_pgdir, va, 0)) ||
+			!(*p & PTE_P)) &&
+			vma_fault(curenv, (uintptr_t) va) == 0)
+			p = pgdir_walk(curenv->env_pgdir, va, 0);
+		if (!p)
+			goto check_failed;
 
-		if ( !(p = pgdir_walk(curenv->env_pgdir, va, 0)) ||
-			(*p & (perm|PTE_P)) != (perm|PTE_P))
+		// copy-on-write pages and page tables count as writable,
+		// the kernel resolves the fault when it writes to them
+		eff = *p;
+		if (eff & PTE_COW)
+			eff |= PTE_W;
+		if ((eff & (perm|PTE_P)) != (perm|PTE_P))
 			goto check_failed;
-		va += PGSIZE;
+
+		// a superpage covers the rest of its 4MB at once
+		if (*p & PTE_PS)
+			va = ROUNDDOWN(va, PTSIZE) + PTSIZE;
+		else
+			va = ROUNDDOWN(va, PGSIZE) + PGSIZE;
 	}
 
 	return 0;
@@ -1210,6 +2596,9 @@ page_check(void)
 {
 	struct Page *pp, *pp0, *pp1, *pp2;
 	struct Page_list fl[MAX_ORDER + 1];
+	size_t saved_nr_free[MAX_ORDER + 1];
+	struct Page *saved_magazine[PCP_SIZE];
+	int saved_nr_magazine, saved_nr_zero;
 	struct Page *saved_pages;
 	pte_t *ptep, *ptep1;
 	void *va;
@@ -1229,13 +2618,24 @@ page_check(void)
 	// mark all pages allocated
 	pages_alloc(&saved_pages, get_order(page_array_size));
 	memmove(page2kva(saved_pages), pages, page_array_size);
-	for (i = 0; i < npage; i++)
+	for (i = 0; i < npage; i++) {
 		PAGE_MARK_ALLOC(&pages[i]);
+		PAGE_UNTAG(&pages[i]);
+	}
 
 	// temporarily steal the rest of the free pages
 	memmove(fl, page_free_list, sizeof(fl));
-	for (i = 0; i <= MAX_ORDER; i++)
+	memmove(saved_nr_free, nr_free, sizeof(saved_nr_free));
+	for (i = 0; i <= MAX_ORDER; i++) {
 		LIST_INIT(&page_free_list[i]);
+		nr_free[i] = 0;
+	}
+	memmove(saved_magazine, page_magazine, sizeof(saved_magazine));
+	saved_nr_magazine = nr_magazine;
+	nr_magazine = 0;
+	// the zero pool is left alone, only hide it
+	saved_nr_zero = nr_zero;
+	nr_zero = 0;
 
 	// should be no free memory
 	assert(page_alloc(&pp) == -E_NO_MEM);
@@ -1362,6 +2762,10 @@ page_check(void)
 
 	// give free list back
 	memmove(page_free_list, fl, sizeof(fl));
+	memmove(nr_free, saved_nr_free, sizeof(saved_nr_free));
+	memmove(page_magazine, saved_magazine, sizeof(saved_magazine));
+	nr_magazine = saved_nr_magazine;
+	nr_zero = saved_nr_zero;
 	memmove(pages, page2kva(saved_pages), page_array_size);
 
 	pages_free(saved_pages, get_order(page_array_size));
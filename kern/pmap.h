@@ -56,12 +56,27 @@ int	pages_alloc(struct Page **pp_store, int order);
 void	pages_free(struct Page *pp, int order);
 int	get_order(unsigned long size);
 int	page_insert(pde_t *pgdir, struct Page *pp, void *va, int perm);
+int	page_insert_large(pde_t *pgdir, struct Page *pp, void *va, int perm);
 void	page_remove(pde_t *pgdir, void *va);
+int	page_remove_range(pde_t *pgdir, uintptr_t start, uintptr_t end);
+int	page_protect_range(pde_t *pgdir, uintptr_t start, uintptr_t end,
+			   int perm);
+int	pgdir_fork(pde_t *dst, pde_t *src);
+int	pgtable_unshare(pde_t *pgdir, void *va);
+void	pgtable_remove(pde_t *pgdir, uint32_t pdeno);
+void	pgtable_reclaim(pde_t *pgdir, void *va);
+void	pgdir_teardown(pde_t *pgdir);
+int	page_cow_fault(pde_t *pgdir, void *va);
 struct 	Page *page_lookup(pde_t *pgdir, void *va, pte_t **pte_store);
 int	page_map_segment(pde_t *pgdir, struct Page *pp, void *va, size_t size, int perm);
 void	page_decref(struct Page *pp);
 
 void	tlb_invalidate(pde_t *pgdir, void *va);
+void	tlb_flush(pde_t *pgdir);
+void	tlb_flush_global(void);
+void	tlb_shootdown(pde_t *pgdir);
+void	tlb_sync(void);
+void	*mmio_map_region(physaddr_t pa, size_t size);
 
 int	user_mem_check(struct Env *env, const void *va, size_t len, int perm);
 void	user_mem_assert(struct Env *env, const void *va, size_t len, int perm);
@@ -113,8 +128,19 @@ void dump_virt(physaddr_t vaddr, size_t len, size_t word);
 // Buddy system specific
 #define page_free(pp)	pages_free(pp, 0)
 void 	pages_free(struct Page *pp, int order);
+void	pages_free_bulk(struct Page **pps, int n);
 #define page_alloc(pp)	pages_alloc(pp, 0)
 int 	pages_alloc(struct Page **pp_store, int order);
+int	page_alloc_zeroed(struct Page **pp_store);
+int	page_alloc_color(struct Page **pp_store, int color);
+
+// Page coloring: pages whose ppns differ by a multiple of PAGE_COLORS
+// map onto the same sets of a physically indexed cache.
+#define PAGE_COLORS	16
+#define page_color(pp)	(page2ppn(pp) & (PAGE_COLORS - 1))
+extern bool page_coloring;	// let sys_page_alloc() color user pages
+void	page_zero_idle(void);
+int	page_compact(struct Page **pp_store, int order);
 
 void 	buddy_info(void);
 
@@ -0,0 +1,132 @@
+/* See COPYRIGHT for copyright information. */
+
+#include <inc/mmu.h>
+#include <inc/error.h>
+#include <inc/assert.h>
+
+#include <kern/pmap.h>
+#include <kern/env.h>
+#include <kern/kmem.h>
+#include <kern/rmap.h>
+
+#define KDEBUG
+#include <kern/kdebug.h>
+
+static struct Kmem_cache *rmap_cache;
+
+void
+rmap_init(void)
+{
+	struct Rmap *rm;
+
+	rmap_cache = kmem_cache_create("rmap", sizeof(struct Rmap), 0, NULL);
+	assert(rmap_cache);
+
+	// leave an empty slab behind, the cache keeps it around
+	if ( (rm = kmem_cache_alloc(rmap_cache)))
+		kmem_cache_free(rmap_cache, rm);
+}
+
+//
+// Record that 'pp' is mapped at 'va' by the page table entry 'pte'.
+// Returns -E_NO_MEM if out of memory.
+//
+int
+rmap_add(struct Page *pp, pte_t *pte, void *va)
+{
+	struct Rmap *rm;
+
+	if (!rmap_cache)
+		return 0;
+	if (!(rm = kmem_cache_alloc(rmap_cache)))
+		return -E_NO_MEM;
+
+	rm->rm_pte = pte;
+	rm->rm_va = (uintptr_t) va;
+	LIST_INSERT_HEAD(&pp->pp_rmap, rm, rm_link);
+	return 0;
+}
+
+//
+// Forget the mapping of 'pp' by 'pte'.
+//
+void
+rmap_del(struct Page *pp, pte_t *pte)
+{
+	struct Rmap *rm;
+
+	LIST_FOREACH(rm, &pp->pp_rmap, rm_link)
+		if (rm->rm_pte == pte) {
+			LIST_REMOVE(rm, rm_link);
+			kmem_cache_free(rmap_cache, rm);
+			return;
+		}
+
+	// only mappings made before rmap_init() may be missing
+	assert(!rmap_cache);
+}
+
+//
+// Hand all the reverse map entries of 'from' over to 'to'.
+// The caller is responsible for the page table entries themselves.
+//
+void
+rmap_move(struct Page *from, struct Page *to)
+{
+	struct Rmap *rm;
+
+	while ( (rm = LIST_FIRST(&from->pp_rmap))) {
+		LIST_REMOVE(rm, rm_link);
+		LIST_INSERT_HEAD(&to->pp_rmap, rm, rm_link);
+	}
+}
+
+//
+// Number of mappings of 'pp'.
+//
+int
+rmap_count(struct Page *pp)
+{
+	struct Rmap *rm;
+	int n = 0;
+
+	LIST_FOREACH(rm, &pp->pp_rmap, rm_link)
+		n++;
+	return n;
+}
+
+//
+// Does the address space of 'e' reach the page table entry 'pte'?
+//
+static bool
+env_maps_pte(struct Env *e, pte_t *pte, uintptr_t va)
+{
+	physaddr_t table = PADDR(ROUNDDOWN(pte, PGSIZE));
+
+	if (e->env_status == ENV_FREE || !e->env_pgdir)
+		return 0;
+	if (*pte & PTE_PS)
+		return e->env_pgdir == (pde_t *) ROUNDDOWN(pte, PGSIZE);
+	return (e->env_pgdir[PDX(va)] & PTE_P) &&
+		PTE_ADDR(e->env_pgdir[PDX(va)]) == table;
+}
+
+void
+rmap_info(struct Page *pp)
+{
+	struct Rmap *rm;
+	int i, n;
+
+	cprintf("ppn %x: %d references, %d mappings\n", page2ppn(pp),
+		pp->pp_ref, rmap_count(pp));
+	LIST_FOREACH(rm, &pp->pp_rmap, rm_link) {
+		cprintf("  va %08x%s, pte at %08x:", rm->rm_va,
+			*rm->rm_pte & PTE_PS ? " (4MB)" : "", rm->rm_pte);
+		for (i = n = 0; i < NENV; i++)
+			if (env_maps_pte(&envs[i], rm->rm_pte, rm->rm_va)) {
+				cprintf(" %08x", envs[i].env_id);
+				n++;
+			}
+		cprintf(n ? "\n" : " no environment\n");
+	}
+}
@@ -0,0 +1,37 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_RMAP_H
+#define JOS_KERN_RMAP_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/queue.h>
+#include <inc/memlayout.h>
+
+// Reverse map of physical pages.
+//
+// Every mapping set up by page_insert() or page_insert_large() links an
+// entry onto the pp_rmap list of the page it maps, and page_remove()
+// unlinks it again, so the entries mapping a page can be found without
+// scanning every address space.  An entry records the PTE (or the PDE,
+// for a superpage) itself rather than an address space, since a page
+// table may be shared by several of them (see pgdir_fork()).
+// Entries come from a slab cache; mappings made before rmap_init()
+// (page_check() only) are not tracked.
+
+struct Rmap {
+	LIST_ENTRY(Rmap) rm_link;	// link on pp_rmap of the page
+	pte_t *rm_pte;			// entry mapping the page
+	uintptr_t rm_va;		// virtual address it maps
+};
+
+void	rmap_init(void);
+int	rmap_add(struct Page *pp, pte_t *pte, void *va);
+void	rmap_del(struct Page *pp, pte_t *pte);
+void	rmap_move(struct Page *from, struct Page *to);
+int	rmap_count(struct Page *pp);
+void	rmap_info(struct Page *pp);
+
+#endif	// !JOS_KERN_RMAP_H
@@ -1,50 +1,383 @@
 #include <inc/assert.h>
+#include <inc/error.h>
 
 #include <kern/env.h>
+#include <kern/sched.h>
 #include <kern/pmap.h>
 #include <kern/monitor.h>
+#include <kern/kclock.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+#include <kern/picirq.h>
 
 #define KDEBUG
 #include <kern/kdebug.h>
 
+// Runnable environments, but the idle one, in the order they get the
+// CPU.  Every change of env_status goes through sched_set_status(),
+// which keeps the queues up to date, so picking the next environment
+// does not depend on NENV.
+//
+// There is one queue per priority (env_prio, 0 is the highest), and
+// the first non-empty queue supplies the next environment.  Priorities
+// follow a multilevel feedback policy:
+//  - a new environment starts at priority 0;
+//  - an environment that used up its whole slice of clock ticks drops
+//    to the next lower priority, where slices are twice as long;
+//  - an environment that blocks in sys_ipc_recv() goes back to
+//    priority 0, as it is waiting for work rather than computing;
+//  - every SCHED_BOOST_TICKS ticks all queued environments move back
+//    to priority 0, so that those at the bottom do not starve.
+// Environments pinned by sys_env_set_priority() keep their priority.
+//
+// Each CPU has its own set of queues.  An environment waits on those of
+// the CPU it last ran on (env_cpunum), a new one on those of the CPU
+// that created it, and leaves its queue while it runs.  A CPU that runs
+// out of environments steals one from the queues of the others, and
+// one that finds none halts until sched_kick() hands it some.
+TAILQ_HEAD(Env_runq, Env);
+static struct Env_runq runq[NCPU][ENV_NPRIO];
+
+#define IS_IDLE(e)	((e) == &envs[0])
+
+// Whether 'e' waits on a run queue, and which one
+#define IS_QUEUED(e)	((e)->env_status == ENV_RUNNABLE && !IS_IDLE(e) && \
+			 !(e)->env_running)
+#define RUNQ(e)		(runq[(e)->env_cpunum][(e)->env_prio])
+
+// Clock ticks an environment may run at priority 'prio' before it
+// gets demoted.
+#define SLICE_TICKS(prio)	(1 << (prio))
+#define SCHED_BOOST_TICKS	100
+
+static uint32_t sched_ticks[NCPU];
+
+// Environments asleep in sched_wait_irq(), linked through env_runq_link
+static struct Env_runq irq_waitq = TAILQ_HEAD_INITIALIZER(irq_waitq);
+
+void
+sched_init(void)
+{
+	int c, i;
+
+	for (c = 0; c < NCPU; c++)
+		for (i = 0; i < ENV_NPRIO; i++)
+			TAILQ_INIT(&runq[c][i]);
+}
+
+//
+// 'e' got queued: wake up its CPU if it halted, or else any halted
+// CPU, which will steal 'e' unless its own CPU gets to it first.
+//
+static void
+sched_kick(struct Env *e)
+{
+	struct Cpu *c = &cpus[e->env_cpunum];
+
+	if (c != thiscpu && c->cpu_idle) {
+		lapic_ipi(c->cpu_apicid, IRQ_OFFSET + IRQ_RESCHED);
+		return;
+	}
+	for (c = cpus; c < cpus + ncpu; c++)
+		if (c != thiscpu && c->cpu_idle) {
+			lapic_ipi(c->cpu_apicid, IRQ_OFFSET + IRQ_RESCHED);
+			return;
+		}
+}
+
+//
+// Set the status of 'e', and queue or dequeue it accordingly.
+// A newly runnable environment waits behind those already runnable
+// at its priority.
+//
+void
+sched_set_status(struct Env *e, unsigned status)
+{
+	if (e->env_status == status)
+		return;
+
+	if (e->env_wait_irqs) {
+		TAILQ_REMOVE(&irq_waitq, e, env_runq_link);
+		e->env_wait_irqs = 0;
+	}
+	if (IS_QUEUED(e))
+		TAILQ_REMOVE(&RUNQ(e), e, env_runq_link);
+	e->env_status = status;
+	if (IS_QUEUED(e)) {
+		TAILQ_INSERT_TAIL(&RUNQ(e), e, env_runq_link);
+		sched_kick(e);
+	}
+}
+
+//
+// Move 'e' to priority 'prio', with a fresh slice.
+// If 'e' is runnable it goes to the back of its new queue.
+//
+static void
+sched_move(struct Env *e, int prio)
+{
+	bool queued = IS_QUEUED(e);
+
+	if (queued)
+		TAILQ_REMOVE(&RUNQ(e), e, env_runq_link);
+	e->env_prio = prio;
+	e->env_slice_used = 0;
+	if (queued)
+		TAILQ_INSERT_TAIL(&RUNQ(e), e, env_runq_link);
+}
+
+//
+// Pin 'e' at priority 'prio', or hand it back to the feedback policy
+// (starting at priority 0) if 'prio' is ENV_PRIO_AUTO.
+//
+int
+sched_set_priority(struct Env *e, int prio)
+{
+	if (prio == ENV_PRIO_AUTO) {
+		e->env_prio_pinned = 0;
+		sched_move(e, 0);
+		return 0;
+	}
+	if (prio < 0 || prio >= ENV_NPRIO)
+		return -E_INVAL;
+
+	e->env_prio_pinned = 1;
+	sched_move(e, prio);
+	return 0;
+}
+
+// 'e' is about to wait for IPC, let it run at the top priority again.
+void
+sched_boost(struct Env *e)
+{
+	if (!e->env_prio_pinned && e->env_prio != 0)
+		sched_move(e, 0);
+}
+
+//
+// Put 'e' to sleep until one of the IRQ lines in the mask 'irqs'
+// interrupts.  Any other change of its status cancels the wait.
+//
+void
+sched_wait_irq(struct Env *e, uint16_t irqs)
+{
+	assert(irqs != 0);
+	sched_set_status(e, ENV_NOT_RUNNABLE);
+	e->env_wait_irqs = irqs;
+	TAILQ_INSERT_TAIL(&irq_waitq, e, env_runq_link);
+}
+
+// Make the environments waiting for 'irq' runnable again.
+void
+sched_wake_irq(int irq)
+{
+	struct Env *e, *next;
+
+	for (e = TAILQ_FIRST(&irq_waitq); e; e = next) {
+		next = TAILQ_NEXT(e, env_runq_link);
+		if (e->env_wait_irqs & (1 << irq)) {
+			sched_boost(e);
+			sched_set_status(e, ENV_RUNNABLE);
+		}
+	}
+}
+
+// Boost the environments queued on this CPU.
+static void
+sched_boost_all(void)
+{
+	struct Env *e, *next;
+	int i;
+
+	for (i = 1; i < ENV_NPRIO; i++)
+		for (e = TAILQ_FIRST(&runq[cpunum()][i]); e; e = next) {
+			next = TAILQ_NEXT(e, env_runq_link);
+			if (!e->env_prio_pinned)
+				sched_move(e, 0);
+		}
+}
+
+//
+// Called on every clock interrupt of every CPU.  Charges the tick to
+// the environment running there, and gives the CPU to another one if
+// curenv used up its slice or a higher priority environment waits on
+// this CPU.  Returns if curenv should keep running.
+//
+void
+sched_tick(void)
+{
+	struct Env *e = curenv;
+	int i;
+
+	// a tick taken while halted, pending when the clock got stopped
+	if (thiscpu->cpu_idle)
+		return;
+
+	if (++sched_ticks[cpunum()] % SCHED_BOOST_TICKS == 0)
+		sched_boost_all();
+
+	if (!e || e->env_status != ENV_RUNNABLE || IS_IDLE(e))
+		sched_yield();
+
+	if (++e->env_slice_used >= SLICE_TICKS(e->env_prio)) {
+		if (!e->env_prio_pinned && e->env_prio < ENV_NPRIO - 1) {
+			DBG(C_SCHED, KDEBUG_FLOW, "env %x drops to priority %d\n",
+				e->env_id, e->env_prio + 1);
+			sched_move(e, e->env_prio + 1);
+		} else
+			e->env_slice_used = 0;
+		sched_yield();
+	}
+
+	for (i = 0; i < e->env_prio; i++)
+		if (!TAILQ_EMPTY(&runq[cpunum()][i]))
+			sched_yield();
+}
+
+//
+// The environment to run next on this CPU: the first one of its own
+// queues, or else the first of the highest priority one can steal.
+//
+static struct Env *
+sched_next(void)
+{
+	struct Env *e;
+	int c, i;
+
+	for (i = 0; i < ENV_NPRIO; i++)
+		if ( (e = TAILQ_FIRST(&runq[cpunum()][i])))
+			return e;
+	for (i = 0; i < ENV_NPRIO; i++)
+		for (c = 0; c < ncpu; c++)
+			if ( (e = TAILQ_FIRST(&runq[c][i])))
+				return e;
+	return NULL;
+}
+
+//
+// Nothing is runnable for this CPU.  Whether it should halt until
+// something is, rather than run envs[0] or the monitor.  Only the boot
+// CPU does those, and only when nothing can ever run again: no
+// environment waits for an interrupt or runs on another CPU.
+//
+static bool
+sched_should_halt(void)
+{
+	struct Cpu *c;
+
+	if (sched_next())
+		return 0;
+	if (thiscpu != bootcpu || !TAILQ_EMPTY(&irq_waitq))
+		return 1;
+	for (c = cpus; c < cpus + ncpu; c++)
+		if (c != thiscpu && c->cpu_env)
+			return 1;
+	return 0;
+}
+
+// Stop or restart the clock interrupts of this CPU: the PIT's on the
+// boot CPU, the local APIC timer's on the others.
+static void
+sched_clock(bool on)
+{
+	if (thiscpu == bootcpu) {
+		if (on)
+			kclock_start();
+		else
+			kclock_stop();
+	} else {
+		if (on)
+			lapic_timer_start();
+		else
+			lapic_timer_stop();
+	}
+}
+
+//
+// Nothing is runnable, but sched_should_halt() says something may be
+// later.  Stop the clock, as there is no slice to end, and halt until
+// an interrupt makes something runnable: a device interrupt, or the
+// IRQ_RESCHED of sched_kick().  Interrupts taken here are kernel-mode
+// traps, which return to the loop below.  The kernel lock is released
+// while halted, so the other CPUs keep going.
+//
+// The page directory of the environment that last ran here goes away
+// with it, and another CPU may free that environment meanwhile, so
+// switch to the kernel's own page directory first.
+//
+static void
+sched_halt(void)
+{
+	// charge the time so far, the rest of it is idle
+	env_charge(0);
+	thiscpu->cpu_idle = 1;
+
+	// the boot CPU may be waiting for the others to run out of work
+	if (thiscpu != bootcpu && bootcpu->cpu_idle)
+		lapic_ipi(bootcpu->cpu_apicid, IRQ_OFFSET + IRQ_RESCHED);
+
+	page_zero_idle();
+	lcr3(boot_cr3);
+
+	DBG(C_SCHED, KDEBUG_FLOW, "halting\n");
+	sched_clock(0);
+	do {
+		unlock_kernel();
+		// sti takes effect after hlt has started, so an interrupt
+		// arriving in between still wakes us up
+		asm volatile("sti; hlt; cli" : : : "memory");
+		lock_kernel();
+	} while (sched_should_halt());
+	sched_clock(1);
+}
+
 // Choose a user environment to run and run it.
 void
 sched_yield(void)
 {
-	// Implement simple round-robin scheduling.
-	// Search through 'envs' for a runnable environment,
-	// in circular fashion starting after the previously running env,
-	// and switch to the first such environment found.
-	// It's OK to choose the previously running env if no other env
-	// is runnable.
-	// But never choose envs[0], the idle environment,
-	// unless NOTHING else is runnable.
+	// Round-robin scheduling within a priority: the environment
+	// giving up the CPU goes to the back of its run queue, and the
+	// one at the head of the highest non-empty queue runs.  That may
+	// be the previously running env if no other env is runnable.
+	// When nothing is runnable but something may become so, the CPU
+	// halts.  envs[0], the idle environment, is never queued and runs
+	// only when NOTHING else can ever run again.
 
-	int target, count = NENV;
+	struct Env *e;
 
-	// If no current running environment, searching started from
-	// envs[1]
-	if (curenv)
-		target = ENVX(curenv->env_id);
-	else
-		target = 0;
+	if (curenv) {
+		// charge the time so far to the env leaving the CPU
+		env_charge(0);
+		curenv->env_running = 0;
+		if (IS_QUEUED(curenv))
+			TAILQ_INSERT_TAIL(&RUNQ(curenv), curenv, env_runq_link);
+		curenv = NULL;
+	}
 
-	while (count-- > 0 &&
-		(envs[target = (++target)%NENV].env_status != ENV_RUNNABLE ||
-		!target));
+	if (sched_should_halt())
+		sched_halt();
 
-	if (count >= 0) {
-		DBG(C_SCHED, KDEBUG_FLOW, "picking environment id %x\n",
-				envs[target].env_id);
-		env_run(&envs[target]);
+	if ( (e = sched_next())) {
+		DBG(C_SCHED, KDEBUG_FLOW,
+			"CPU %d picking environment id %x, priority %d\n",
+			cpunum(), e->env_id, e->env_prio);
+		TAILQ_REMOVE(&RUNQ(e), e, env_runq_link);
+		e->env_cpunum = cpunum();
+		e->env_running = 1;
+		env_run(e);
 	}
 
 	DBG(C_SCHED, KDEBUG_FLOW,
 		"Nothing else is runnable, picking idle environment\n");
 
 	// Run the special idle environment when nothing else is runnable.
-	if (envs[0].env_status == ENV_RUNNABLE)
+	// Nobody is waiting for the CPU, so clear some pages in advance.
+	if (envs[0].env_status == ENV_RUNNABLE) {
+		page_zero_idle();
+		envs[0].env_cpunum = cpunum();
+		envs[0].env_running = 1;
 		env_run(&envs[0]);
+	}
 	else {
 		cprintf("Destroyed all environments - nothing more to do!\n");
 		while (1)
@@ -6,7 +6,16 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/env.h>
+
 // This function does not return.
 void sched_yield(void) __attribute__((noreturn));
+void sched_init(void);
+void sched_set_status(struct Env *e, unsigned status);
+int sched_set_priority(struct Env *e, int prio);
+void sched_boost(struct Env *e);
+void sched_tick(void);
+void sched_wait_irq(struct Env *e, uint16_t irqs);
+void sched_wake_irq(int irq);
 
 #endif	// !JOS_KERN_SCHED_H
@@ -0,0 +1,46 @@
+/* See COPYRIGHT for copyright information. */
+
+#include <inc/types.h>
+#include <inc/assert.h>
+#include <inc/x86.h>
+
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
+
+struct Spinlock kernel_lock = SPINLOCK_INITIALIZER("kernel_lock");
+
+// Whether this CPU holds the lock.
+bool
+spin_holding(struct Spinlock *lk)
+{
+	return lk->locked && lk->cpu == thiscpu;
+}
+
+void
+spin_lock(struct Spinlock *lk)
+{
+	if (spin_holding(lk))
+		panic("CPU %d cannot acquire %s: already holding",
+			cpunum(), lk->name);
+
+	// The xchg is atomic, and it serializes, so that the reads of
+	// the critical section are not reordered before the lock is held.
+	while (xchg(&lk->locked, 1) != 0)
+		asm volatile ("pause");
+
+	lk->cpu = thiscpu;
+}
+
+void
+spin_unlock(struct Spinlock *lk)
+{
+	if (!spin_holding(lk))
+		panic("CPU %d cannot release %s: not holding it",
+			cpunum(), lk->name);
+
+	lk->cpu = NULL;
+
+	// The xchg makes the writes of the critical section visible
+	// before the lock is seen free.
+	xchg(&lk->locked, 0);
+}
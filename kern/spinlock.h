@@ -0,0 +1,44 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_SPINLOCK_H
+#define JOS_KERN_SPINLOCK_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+struct Cpu;
+
+// Mutual exclusion lock.
+struct Spinlock {
+	volatile uint32_t locked;	// Is the lock held?
+	const char *name;		// Name of lock, for panics
+	struct Cpu *cpu;		// The CPU holding the lock
+};
+
+#define SPINLOCK_INITIALIZER(name)	{ 0, (name), NULL }
+
+void	spin_lock(struct Spinlock *lk);
+void	spin_unlock(struct Spinlock *lk);
+bool	spin_holding(struct Spinlock *lk);
+
+// The big kernel lock.  One CPU at a time runs the kernel; the others
+// run user environments, halt in sched_halt(), or wait for the lock in
+// trap().  The kernel runs with interrupts off, so holding the lock is
+// never interrupted, but for the faults on user memory it handles.
+extern struct Spinlock kernel_lock;
+
+static inline void
+lock_kernel(void)
+{
+	spin_lock(&kernel_lock);
+}
+
+static inline void
+unlock_kernel(void)
+{
+	spin_unlock(&kernel_lock);
+}
+
+#endif	// !JOS_KERN_SPINLOCK_H
@@ -11,6 +11,9 @@
 #include <kern/syscall.h>
 #include <kern/console.h>
 #include <kern/sched.h>
+#include <kern/buddy.h>
+#include <kern/vma.h>
+#include <kern/uaccess.h>
 
 #define KDEBUG
 #include <kern/kdebug.h>
@@ -21,27 +24,37 @@
 static void
 sys_cputs(const char *s, size_t len)
 {
-	// Check that the user has permission to read memory [s, s+len).
-	// Destroy the environment if not.
-	user_mem_assert(curenv, s, len, 0);
-
-	// Print the string supplied by the user.
-	cprintf("%.*s", len, s);
+	char buf[128];
+	size_t n;
+
+	// Print the string supplied by the user, a chunk at a time.
+	// Destroy the environment if it may not read memory [s, s+len).
+	for (; len; s += n, len -= n) {
+		n = MIN(len, sizeof(buf));
+		if (copy_from_user(buf, s, n) < 0) {
+			cprintf("[%08x] sys_cputs: bad string at va %08x\n",
+				curenv->env_id, s);
+			env_destroy(curenv);
+			return;
+		}
+		cprintf("%.*s", n, buf);
+	}
 }
 
 // Read a character from the system console.
-// Returns the character.
+// Returns the character, or 0 if there was none yet.  In that case the
+// caller sleeps until the keyboard or the serial port interrupts, and
+// should try again once it runs.
 static int
 sys_cgetc(void)
 {
 	int c;
 
-	// The cons_getc() primitive doesn't wait for a character,
-	// but the sys_cgetc() system call does.
-	while ((c = cons_getc()) == 0)
-		/* do nothing */;
+	if ( (c = cons_getc()))
+		return c;
 
-	return c;
+	sched_wait_irq(curenv, (1 << IRQ_KBD) | (1 << IRQ_SERIAL));
+	return 0;
 }
 
 // Returns the current environment's envid.
@@ -51,6 +64,19 @@ sys_getenvid(void)
 	return curenv->env_id;
 }
 
+// Store the CPU time the current environment has used so far in 'ct'.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_FAULT if ct is not writable user memory.
+static int
+sys_env_cputime(struct Env_cputime *ct)
+{
+	struct Env_cputime kct;
+
+	env_cputime(curenv, &kct);
+	return copy_to_user(ct, &kct, sizeof(kct));
+}
+
 // Destroy a given environment (possibly the currently running environment).
 //
 // Returns 0 on success, < 0 on error.  Errors are:
@@ -99,7 +125,7 @@ sys_exofork(void)
 	if ( (r = env_alloc(&e, 0)) < 0)
 		return r;
 
-	e->env_status = ENV_NOT_RUNNABLE;
+	sched_set_status(e, ENV_NOT_RUNNABLE);
 	e->env_parent_id = curenv->env_id;
 	e->env_tf = curenv->env_tf;
 	e->env_tf.tf_regs.reg_eax = 0;
@@ -107,6 +133,52 @@ sys_exofork(void)
 	return e->env_id;
 }
 
+// Create a copy of the current environment, with copy-on-write
+// sharing of its address space (see pgdir_fork()), a fresh user
+// exception stack if it has a page fault upcall, and the same upcall.
+// Unlike sys_exofork, the child is ready to run.
+//
+// Returns envid of the child to the parent, 0 to the child, or < 0
+// on error.  Errors are:
+//	-E_NO_FREE_ENV if no free environment is available.
+//	-E_NO_MEM if out of memory.
+static envid_t
+sys_fork(void)
+{
+	struct Env *e;
+	struct Page *pp;
+	int r;
+
+	if ( (r = env_alloc(&e, curenv->env_id)) < 0)
+		return r;
+
+	sched_set_status(e, ENV_NOT_RUNNABLE);
+	e->env_tf = curenv->env_tf;
+	e->env_tf.tf_regs.reg_eax = 0;
+	e->env_pgfault_upcall = curenv->env_pgfault_upcall;
+
+	if ( (r = pgdir_fork(e->env_pgdir, curenv->env_pgdir)) < 0 ||
+		(r = vma_fork(e, curenv)) < 0)
+		goto fail;
+
+	if (e->env_pgfault_upcall) {
+		if ( (r = page_alloc(&pp)) < 0)
+			goto fail;
+		if ( (r = page_insert(e->env_pgdir, pp,
+			(void *) (UXSTACKTOP - PGSIZE), PTE_U|PTE_W|PTE_P)) < 0) {
+			page_free(pp);
+			goto fail;
+		}
+	}
+
+	sched_set_status(e, ENV_RUNNABLE);
+	return e->env_id;
+
+fail:
+	env_free(e);
+	return r;
+}
+
 // Set envid's env_status to status, which must be ENV_RUNNABLE
 // or ENV_NOT_RUNNABLE.
 //
@@ -132,10 +204,30 @@ sys_env_set_status(envid_t envid, int status)
 	if ( (r = envid2env(envid, &e, 1)) < 0)
 		return r;
 
-	e->env_status = status;
+	sched_set_status(e, status);
 	return 0;
 }
 
+// Pin envid at scheduling priority 'prio', 0 being the highest, so that
+// it is neither demoted for using up its slices nor boosted.
+// ENV_PRIO_AUTO hands envid back to the feedback policy.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if prio is neither ENV_PRIO_AUTO nor below ENV_NPRIO.
+static int
+sys_env_set_priority(envid_t envid, int prio)
+{
+	struct Env *e;
+	int r;
+
+	if ( (r = envid2env(envid, &e, 1)) < 0)
+		return r;
+
+	return sched_set_priority(e, prio);
+}
+
 // Set envid's trap frame to 'tf'.
 // tf is modified to make sure that user environments always run at code
 // protection level 3 (CPL 3) with interrupts enabled.
@@ -171,7 +263,9 @@ sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
 // Set the page fault upcall for 'envid' by modifying the corresponding struct
 // Env's 'env_pgfault_upcall' field.  When 'envid' causes a page fault, the
 // kernel will push a fault record onto the exception stack, then branch to
-// 'func'.
+// 'func'.  'func' is an address in envid's address space, so it is not
+// checked here: an upcall that cannot run just faults again, until the
+// environment runs out of exception stack and is destroyed.
 //
 // Returns 0 on success, < 0 on error.  Errors are:
 //	-E_BAD_ENV if environment envid doesn't currently exist,
@@ -182,8 +276,6 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 	struct Env *e;
 	int r;
 
-	user_mem_assert(curenv, func, 4, 0);
-
 	if ( (r = envid2env(envid, &e, 1)) < 0)
 		return r;
 
@@ -194,7 +286,7 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 
 // Allocate a page of memory and map it at 'va' with permission
 // 'perm' in the address space of 'envid'.
-// The page's contents are set to 0.
+// If 'zero' is set, the page's contents are set to 0.
 // If a page is already mapped at 'va', that page is unmapped as a
 // side effect.
 //
@@ -209,7 +301,7 @@ sys_env_set_pgfault_upcall(envid_t envid, void *func)
 //	-E_NO_MEM if there's no memory to allocate the new page,
 //		or to allocate any necessary page tables.
 static int
-sys_page_alloc(envid_t envid, void *va, int perm)
+env_page_alloc(envid_t envid, void *va, int perm, bool zero)
 {
 	// Hint: This function is a wrapper around page_alloc() and
 	//   page_insert() from kern/pmap.c.
@@ -233,9 +325,22 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 		(perm & ~(perm_check|PTE_AVAIL|PTE_W)))
 		return -E_INVAL;
 
-	if ( (r = page_alloc(&pp)))
+	if ( (r = vma_reserve(e, VMA_RESERVE)) < 0)
 		return r;
 
+	// with page coloring, consecutive pages of an environment get
+	// consecutive colors, starting from a color picked by its envid
+	if (page_coloring)
+		r = page_alloc_color(&pp, PPN(va) + ENVX(e->env_id));
+	else if (zero)
+		r = page_alloc_zeroed(&pp);
+	else
+		r = page_alloc(&pp);
+	if (r < 0)
+		return r;
+	if (page_coloring && zero)
+		memset(page2kva(pp), 0, PGSIZE);
+
 	DBG(C_VM, KDEBUG_FLOW,
 		"[%08x] alloc a page(ppn: 0x%x) onto va 0x%08x\n",
 		e->env_id, page2ppn(pp), va);
@@ -245,6 +350,164 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 		return r;
 	}
 
+	r = vma_map(e, (uintptr_t)va, (uintptr_t)va + PGSIZE, perm, VMA_PAGES);
+	assert(r == 0);
+	return 0;
+}
+
+// Allocate a page of memory and map it at 'va' with permission
+// 'perm' in the address space of 'envid'.  See env_page_alloc().
+static int
+sys_page_alloc(envid_t envid, void *va, int perm)
+{
+	return env_page_alloc(envid, va, perm, 0);
+}
+
+// Same as sys_page_alloc, but the page is guaranteed to be zero-filled.
+// Pages cleared while the system was idle are used when available.
+static int
+sys_page_alloc_zeroed(envid_t envid, void *va, int perm)
+{
+	return env_page_alloc(envid, va, perm, 1);
+}
+
+// Allocate a 4MB superpage, 2^SUPERPAGE_ORDER physically contiguous
+// pages, and map it at 'va' in the address space of 'envid' with a single
+// page directory entry.  Anything mapped in [va, va+PTSIZE) is unmapped
+// as a side effect.  Like sys_page_alloc, the contents are not cleared.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va >= UTOP, or va is not PTSIZE-aligned.
+//	-E_INVAL if perm is inappropriate (see sys_page_alloc).
+//	-E_NO_MEM if there's no contiguous 4MB of memory left.
+static int
+sys_page_alloc_large(envid_t envid, void *va, int perm)
+{
+	struct Env *e;
+	struct Page *pp;
+	int r;
+	int perm_check = PTE_U | PTE_P;
+
+	if ( (r = envid2env(envid, &e, 1)) < 0)
+		return r;
+
+	if ((uintptr_t)va & (PTSIZE - 1) || (uintptr_t)va >= UTOP)
+		return -E_INVAL;
+
+	if ( (perm & perm_check) != perm_check ||
+		(perm & ~(perm_check|PTE_AVAIL|PTE_W)))
+		return -E_INVAL;
+
+	if ( (r = vma_reserve(e, VMA_RESERVE)) < 0)
+		return r;
+
+	if ( (r = pages_alloc(&pp, SUPERPAGE_ORDER)))
+		return r;
+
+	DBG(C_VM, KDEBUG_FLOW,
+		"[%08x] alloc a superpage(ppn: 0x%x) onto va 0x%08x\n",
+		e->env_id, page2ppn(pp), va);
+
+	if ( (r = page_insert_large(e->env_pgdir, pp, va, perm))) {
+		pages_free(pp, SUPERPAGE_ORDER);
+		return r;
+	}
+
+	r = vma_map(e, (uintptr_t)va, (uintptr_t)va + PTSIZE, perm, VMA_PAGES);
+	assert(r == 0);
+	return 0;
+}
+
+// Reserve [va, va+len) of envid's address space as demand-zero memory
+// with permission 'perm'.  Nothing is allocated now: the first access
+// to each page faults, and the kernel maps a zeroed page there without
+// calling the environment's page fault upcall.  Pages already mapped in
+// the range stay as they are, but the range replaces whatever memory
+// area was recorded there.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va or len is not page-aligned, len is 0, or the range
+//		reaches above UTOP.
+//	-E_INVAL if perm is inappropriate (see sys_page_alloc).
+//	-E_NO_MEM if there's no memory to record the range
+//		(see kern/vma.h).
+static int
+sys_page_reserve(envid_t envid, void *va, size_t len, int perm)
+{
+	struct Env *e;
+	int r;
+	int perm_check = PTE_U | PTE_P;
+
+	if ( (r = envid2env(envid, &e, 1)) < 0)
+		return r;
+
+	if (PGOFF(va) || PGOFF(len) || len == 0 ||
+		(uintptr_t)va >= UTOP || len > UTOP - (uintptr_t)va)
+		return -E_INVAL;
+
+	if ( (perm & perm_check) != perm_check ||
+		(perm & ~(perm_check|PTE_AVAIL|PTE_W)))
+		return -E_INVAL;
+
+	return vma_map(e, (uintptr_t)va, (uintptr_t)va + len, perm, VMA_ZERO);
+}
+
+// The checks and work of sys_page_map(), once both environments are
+// known.
+static int
+env_page_map(struct Env *src_env, void *srcva,
+	     struct Env *dst_env, void *dstva, int perm)
+{
+	int r;
+	int perm_check = PTE_U | PTE_P;
+	pte_t *src_pte;
+	struct Page *src_pp;
+	size_t size;
+
+	if (PGOFF(srcva) || (uintptr_t)srcva >= UTOP)
+		return -E_INVAL;
+
+	if (PGOFF(dstva) || (uintptr_t)dstva >= UTOP)
+		return -E_INVAL;
+
+	if ( (perm & perm_check) != perm_check ||
+		(perm & ~(perm_check|PTE_AVAIL|PTE_W)))
+		return -E_INVAL;
+
+	// writable mappings of a copy-on-write page need a private copy
+	// of it first, just as if the source had written to it
+	if ((perm & PTE_W) &&
+		page_cow_fault(src_env->env_pgdir, srcva) == -E_NO_MEM)
+		return -E_NO_MEM;
+
+	if ( !(src_pp = page_lookup(src_env->env_pgdir, srcva, &src_pte)))
+		return -E_INVAL;
+
+	if (perm & PTE_W && !(*src_pte & PTE_W))
+		return -E_INVAL;
+
+	if ( (r = vma_reserve(dst_env, VMA_RESERVE)) < 0)
+		return r;
+
+	if (*src_pte & PTE_PS) {
+		if ((uintptr_t)srcva & (PTSIZE - 1))
+			return -E_INVAL;
+		size = PTSIZE;
+		r = page_insert_large(dst_env->env_pgdir, src_pp, dstva, perm);
+	} else {
+		size = PGSIZE;
+		r = page_insert(dst_env->env_pgdir, src_pp, dstva, perm);
+	}
+	if (r < 0)
+		return r;
+
+	r = vma_map(dst_env, (uintptr_t)dstva, (uintptr_t)dstva + size, perm,
+		VMA_PAGES);
+	assert(r == 0);
 	return 0;
 }
 
@@ -263,6 +526,8 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 //	-E_INVAL if perm is inappropriate (see sys_page_alloc).
 //	-E_INVAL if (perm & PTE_W), but srcva is read-only in srcenvid's
 //		address space.
+//	-E_INVAL if srcva lies in a superpage, but srcva or dstva is not
+//		PTSIZE-aligned.  The whole superpage is mapped at dstva.
 //	-E_NO_MEM if there's no memory to allocate the new page,
 //		or to allocate any necessary page tables.
 static int
@@ -278,15 +543,6 @@ sys_page_map(envid_t srcenvid, void *srcva,
 
 	struct Env *src_env, *dst_env;
 	int r;
-	int perm_check = PTE_U | PTE_P;
-	pte_t *src_pte;
-	struct Page *src_pp;
-
-	if (PGOFF(srcva) || (uintptr_t)srcva >= UTOP)
-		return -E_INVAL;
-
-	if (PGOFF(dstva) || (uintptr_t)dstva >= UTOP)
-		return -E_INVAL;
 
 	if ( (r = envid2env(srcenvid, &src_env, 1)) < 0)
 		return r;
@@ -294,21 +550,73 @@ sys_page_map(envid_t srcenvid, void *srcva,
 	if ( (r = envid2env(dstenvid, &dst_env, 1)) < 0)
 		return r;
 
-	if ( (perm & perm_check) != perm_check ||
-		(perm & ~(perm_check|PTE_AVAIL|PTE_W)))
-		return -E_INVAL;
+	return env_page_map(src_env, srcva, dst_env, dstva, perm);
+}
 
-	if ( !(src_pp = page_lookup(src_env->env_pgdir, srcva, &src_pte))
-		&& !(*src_pte & PTE_P))
-		return -E_INVAL;
+// Apply 'n' page mappings from the address space of 'srcenvid' into
+// that of 'dstenvid' with a single system call.  'maps' is an array of
+// struct Page_map in the caller's address space: each entry is handled
+// as sys_page_map(srcenvid, pm_srcva, dstenvid, pm_dstva, pm_perm)
+// would, in order, and its result is stored in pm_status.  A failing
+// entry does not stop the ones after it.  All entries are read before
+// any is applied, so entries may remap or unmap the array itself.
+// Remapping it copy-on-write is fine: storing the results resolves
+// that like a write by the caller would.  Results that can no longer
+// be stored are dropped.
+//
+// Returns the number of entries that failed, or < 0 on error.  Errors are:
+//	-E_BAD_ENV if srcenvid and/or dstenvid doesn't currently exist,
+//		or the caller doesn't have permission to change one of them.
+//	-E_INVAL if n > PAGE_MAP_MAX.
+//	-E_FAULT if maps is not readable and writable by the caller,
+//		no entry is processed then.
+//	-E_NO_MEM if out of memory.
+static int
+sys_page_map_batch(envid_t srcenvid, envid_t dstenvid,
+		   struct Page_map *maps, unsigned n)
+{
+	struct Env *src_env, *dst_env;
+	struct Page_map *pm;
+	struct Page *pp;
+	int r, nfail = 0;
+	unsigned i;
 
-	if (perm & PTE_W && !(*src_pte & PTE_W))
+	static_assert(PAGE_MAP_MAX * sizeof(struct Page_map) <= PGSIZE);
+	if (n > PAGE_MAP_MAX)
 		return -E_INVAL;
 
-	if ( (r = page_insert(dst_env->env_pgdir, src_pp, dstva, perm)) < 0)
+	if ( (r = envid2env(srcenvid, &src_env, 1)) < 0)
 		return r;
 
-	return 0;
+	if ( (r = envid2env(dstenvid, &dst_env, 1)) < 0)
+		return r;
+
+	if (user_mem_check(curenv, maps, n * sizeof(*maps), PTE_U|PTE_W) < 0)
+		return -E_FAULT;
+
+	// snapshot the whole array first, the entries may unmap it
+	if ( (r = page_alloc(&pp)) < 0)
+		return r;
+	pm = page2kva(pp);
+	if ( (r = copy_from_user(pm, maps, n * sizeof(*maps))) < 0)
+		goto out;
+
+	for (i = 0; i < n; i++) {
+		pm[i].pm_status = env_page_map(src_env, pm[i].pm_srcva,
+			dst_env, pm[i].pm_dstva, pm[i].pm_perm);
+		if (pm[i].pm_status < 0)
+			nfail++;
+	}
+
+	for (i = 0; i < n; i++)
+		if (copy_to_user(&maps[i].pm_status, &pm[i].pm_status,
+			sizeof(pm[i].pm_status)) < 0)
+			break;
+	r = nfail;
+
+out:
+	page_free(pp);
+	return r;
 }
 
 // Unmap the page of memory at 'va' in the address space of 'envid'.
@@ -318,6 +626,8 @@ sys_page_map(envid_t srcenvid, void *srcva,
 //	-E_BAD_ENV if environment envid doesn't currently exist,
 //		or the caller doesn't have permission to change envid.
 //	-E_INVAL if va >= UTOP, or va is not page-aligned.
+//	-E_NO_MEM if a shared page table could not be copied, or a memory
+//		area could not be split (see kern/vma.h).
 static int
 sys_page_unmap(envid_t envid, void *va)
 {
@@ -332,11 +642,96 @@ sys_page_unmap(envid_t envid, void *va)
 	if (PGOFF(va) || (uintptr_t)va >= UTOP)
 		return -E_INVAL;
 
+	if ( (r = pgtable_unshare(e->env_pgdir, va)) < 0 ||
+		(r = vma_unmap(e, (uintptr_t)va, (uintptr_t)va + PGSIZE)) < 0)
+		return r;
 	page_remove(e->env_pgdir, va);
+	pgtable_reclaim(e->env_pgdir, va);
 
 	return 0;
 }
 
+// Unmap every page in [va, va+len) of envid's address space, with one
+// TLB flush for the whole range when it is large.  Unmapped pages are
+// skipped, and superpages must be covered entirely.  The range is
+// dropped from the recorded memory areas, demand-zero ones included.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va or len is not page-aligned, or the range reaches
+//		above UTOP.
+//	-E_INVAL if the range covers part of a superpage.
+//	-E_NO_MEM if a shared page table could not be copied, or a memory
+//		area could not be split (see kern/vma.h).
+static int
+sys_page_unmap_range(envid_t envid, void *va, size_t len)
+{
+	struct Env *e;
+	int r;
+
+	if ( (r = envid2env(envid, &e, 1)) < 0)
+		return r;
+
+	if (PGOFF(va) || PGOFF(len) ||
+		(uintptr_t)va >= UTOP || len > UTOP - (uintptr_t)va)
+		return -E_INVAL;
+
+	if (len == 0)
+		return 0;
+	if ( (r = vma_reserve(e, VMA_RESERVE)) < 0 ||
+		(r = page_remove_range(e->env_pgdir, (uintptr_t)va,
+		(uintptr_t)va + len)) < 0)
+		return r;
+	r = vma_unmap(e, (uintptr_t)va, (uintptr_t)va + len);
+	assert(r == 0);
+	return 0;
+}
+
+// Set the permissions of every page mapped in [va, va+len) of envid's
+// address space to 'perm', editing the page table entries in place.
+// Perm has the same restrictions as in sys_page_map: it must not grant
+// write access to a read-only page.  Copy-on-write pages stay so.
+//
+// Return 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+//	-E_INVAL if va or len is not page-aligned, or the range reaches
+//		above UTOP.
+//	-E_INVAL if perm is inappropriate (see sys_page_alloc).
+//	-E_INVAL if (perm & PTE_W), but a page in the range is read-only.
+//	-E_INVAL if the range covers part of a superpage.
+//	-E_NO_MEM if a shared page table could not be copied, or a memory
+//		area could not be split (see kern/vma.h).
+static int
+sys_page_protect_range(envid_t envid, void *va, size_t len, int perm)
+{
+	struct Env *e;
+	int r;
+	int perm_check = PTE_U | PTE_P;
+
+	if ( (r = envid2env(envid, &e, 1)) < 0)
+		return r;
+
+	if (PGOFF(va) || PGOFF(len) ||
+		(uintptr_t)va >= UTOP || len > UTOP - (uintptr_t)va)
+		return -E_INVAL;
+
+	if ( (perm & perm_check) != perm_check ||
+		(perm & ~(perm_check|PTE_AVAIL|PTE_W)))
+		return -E_INVAL;
+
+	if (len == 0)
+		return 0;
+	if ( (r = vma_reserve(e, VMA_RESERVE)) < 0 ||
+		(r = page_protect_range(e->env_pgdir, (uintptr_t)va,
+		(uintptr_t)va + len, perm)) < 0)
+		return r;
+	r = vma_protect(e, (uintptr_t)va, (uintptr_t)va + len, perm);
+	assert(r == 0);
+	return 0;
+}
+
 // Try to send 'value' to the target env 'envid'.
 // If va != 0, then also send page currently mapped at 'va',
 // so that receiver gets a duplicate mapping of the same page.
@@ -375,14 +770,9 @@ static int
 sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 {
 	struct Env *dst_env;
-	int perm_check = PTE_U | PTE_P;
 	int r;
-	pte_t *pte = 0;
 
-	if (srcva && ((uintptr_t)srcva >= UTOP || (uintptr_t)srcva & ~PGSIZE
-		|| (perm & perm_check) != perm_check
-		|| !(pte = pgdir_walk(curenv->env_pgdir, srcva, 0))
-		|| (*pte & perm_check) != perm_check))
+	if (srcva && ((uintptr_t)srcva >= UTOP || PGOFF(srcva)))
 		return -E_INVAL;
 
 	if ( (r = envid2env(envid, &dst_env, 0)) < 0)
@@ -390,30 +780,25 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 
 	if (!dst_env->env_ipc_recving)
 		return -E_IPC_NOT_RECV;
-	// target environment is willing to receive
-	else {
-		DBG(C_ENV, KDEBUG_VERBOSE, "[%08x] sending value %x to %x\n",
-			curenv->env_id, value, dst_env->env_id);
-		dst_env->env_ipc_recving = 0;
-		dst_env->env_ipc_from = curenv->env_id;
-		dst_env->env_ipc_value = value;
-		dst_env->env_status = ENV_RUNNABLE;
-
-		if (dst_env->env_ipc_perm && srcva) {
-			struct Page *pp = pa2page(PGOFF(pte));
-
-			dst_env->env_ipc_perm = perm;
-			if ( (r = page_insert(dst_env->env_pgdir, pp,
-				dst_env->env_ipc_dstva, perm)) < 0)
-				return r;
-
-			return 1;
-		}
-		else {
-			dst_env->env_ipc_perm = 0;
-			return 0;
-		}
-	}
+
+	// target environment is willing to receive, map the page first
+	// so that nothing changes if that fails
+	if (dst_env->env_ipc_perm && srcva) {
+		if ( (r = env_page_map(curenv, srcva, dst_env,
+			dst_env->env_ipc_dstva, perm)) < 0)
+			return r;
+	} else
+		perm = 0;
+
+	DBG(C_ENV, KDEBUG_VERBOSE, "[%08x] sending value %x to %x\n",
+		curenv->env_id, value, dst_env->env_id);
+	dst_env->env_ipc_recving = 0;
+	dst_env->env_ipc_from = curenv->env_id;
+	dst_env->env_ipc_value = value;
+	dst_env->env_ipc_perm = perm;
+	sched_set_status(dst_env, ENV_RUNNABLE);
+
+	return perm ? 1 : 0;
 }
 
 // Block until a value is ready.  Record that you want to receive
@@ -430,7 +815,7 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 static int
 sys_ipc_recv(void *dstva)
 {
-	if (dstva && ((uintptr_t)dstva >= UTOP || (uintptr_t)dstva & ~PGSIZE))
+	if (dstva && ((uintptr_t)dstva >= UTOP || PGOFF(dstva)))
 		return -E_INVAL;
 
 	curenv->env_ipc_recving = 1;
@@ -443,7 +828,8 @@ sys_ipc_recv(void *dstva)
 		curenv->env_ipc_perm = 0;
 	}
 	
-	curenv->env_status = ENV_NOT_RUNNABLE;
+	sched_set_status(curenv, ENV_NOT_RUNNABLE);
+	sched_boost(curenv);
 
 	return 0;
 }
@@ -466,15 +852,37 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 		return sys_env_destroy((envid_t)a1);
 	case SYS_getenvid:
 		return sys_getenvid();
+	case SYS_env_cputime:
+		return sys_env_cputime((struct Env_cputime *)a1);
 	case SYS_exofork:
 		return sys_exofork();
 	case SYS_env_set_status:
 		return sys_env_set_status((envid_t)a1, (int)a2);
+	case SYS_env_set_priority:
+		return sys_env_set_priority((envid_t)a1, (int)a2);
 	case SYS_page_alloc:
 		return sys_page_alloc((envid_t)a1, (void *)a2, (int)a3);
+	case SYS_page_alloc_zeroed:
+		return sys_page_alloc_zeroed((envid_t)a1, (void *)a2, (int)a3);
+	case SYS_page_alloc_large:
+		return sys_page_alloc_large((envid_t)a1, (void *)a2, (int)a3);
 	case SYS_page_map:
 		return sys_page_map((envid_t)a1, (void *)a2,
 				(envid_t)a3, (void *)a4, (int)a5);
+	case SYS_fork:
+		return sys_fork();
+	case SYS_page_map_batch:
+		return sys_page_map_batch((envid_t)a1, (envid_t)a2,
+				(struct Page_map *)a3, (unsigned)a4);
+	case SYS_page_reserve:
+		return sys_page_reserve((envid_t)a1, (void *)a2,
+				(size_t)a3, (int)a4);
+	case SYS_page_unmap_range:
+		return sys_page_unmap_range((envid_t)a1, (void *)a2,
+				(size_t)a3);
+	case SYS_page_protect_range:
+		return sys_page_protect_range((envid_t)a1, (void *)a2,
+				(size_t)a3, (int)a4);
 	case SYS_page_unmap:
 		return sys_page_unmap((envid_t)a1, (void *)a2);
 	case SYS_env_set_pgfault_upcall:
@@ -9,10 +9,13 @@
 #include <kern/env.h>
 #include <kern/syscall.h>
 #include <kern/sched.h>
+#include <kern/vma.h>
+#include <kern/uaccess.h>
 #include <kern/kclock.h>
 #include <kern/picirq.h>
+#include <kern/cpu.h>
+#include <kern/spinlock.h>
 
-static struct Taskstate ts;
 
 /* Interrupt descriptor table.  (Must be built at run time because
  * shifted function addresses can't be represented in relocation records.)
@@ -62,8 +65,6 @@ static const char *trapname(int trapno)
 void
 idt_init(void)
 {
-	extern struct Segdesc gdt[];
-	
 	// call patcher functions that generate idt entries
 	typedef void (*funcptr)(void);
 	extern const char __IDT_PATCHER_BEGIN__[], __IDT_PATCHER_END__[];
@@ -72,18 +73,29 @@ idt_init(void)
 		idt_patcher < (funcptr *)__IDT_PATCHER_END__; idt_patcher++)
 		(*idt_patcher)();
 
+	trap_init_percpu();
+}
+
+// Load the TSS and the IDT on the CPU executing this.
+void
+trap_init_percpu(void)
+{
+	extern struct Segdesc gdt[];
+	struct Taskstate *ts = &thiscpu->cpu_ts;
+	int id = thiscpu->cpu_id;
+
 	// Setup a TSS so that we get the right stack
 	// when we trap to the kernel.
-	ts.ts_esp0 = KSTACKTOP;
-	ts.ts_ss0 = GD_KD;
+	ts->ts_esp0 = CPU_KSTACKTOP(id);
+	ts->ts_ss0 = GD_KD;
 
-	// Initialize the TSS field of the gdt.
-	gdt[GD_TSS >> 3] = SEG16(STS_T32A, (uint32_t) (&ts),
+	// Initialize this CPU's TSS field of the gdt.
+	gdt[(GD_TSS0 >> 3) + id] = SEG16(STS_T32A, (uint32_t) ts,
 					sizeof(struct Taskstate), 0);
-	gdt[GD_TSS >> 3].sd_s = 0;
+	gdt[(GD_TSS0 >> 3) + id].sd_s = 0;
 
 	// Load the TSS
-	ltr(GD_TSS);
+	ltr(GD_TSS0 + (id << 3));
 
 	// Load the IDT
 	asm volatile("lidt idt_pd");
@@ -122,7 +134,7 @@ void
 enable_sep(void)
 {
 	wrmsr(0x174, (uint32_t) GD_KT, 0);	// SYSENTER_CS_MSR
-	wrmsr(0x175, (uint32_t) KSTACKTOP, 0);	// SYSENTER_ESP_MSR
+	wrmsr(0x175, (uint32_t) CPU_KSTACKTOP(cpunum()), 0);	// SYSENTER_ESP_MSR
 	wrmsr(0x176, (uint32_t) syscall, 0);	// SYSENTER_EIP_MSR
 }
 
@@ -155,9 +167,33 @@ trap_dispatch(struct Trapframe *tf)
 		return;
 	}
 	
-	// Handle clock interrupts.
-	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TIMER)
-		sched_yield();
+	// Handle clock interrupts, from the PIT on the boot CPU and from
+	// the local APIC timer on the others.
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TIMER) {
+		lapic_eoi();
+		sched_tick();
+		return;
+	}
+
+	// Another CPU queued work for this one (see sched_kick()), or wants
+	// curenv destroyed (see env_destroy()).  Getting here was the point.
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_RESCHED) {
+		lapic_eoi();
+		return;
+	}
+
+	// Handle console interrupts: buffer the input, and wake up the
+	// environments waiting for it in sys_cgetc().
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_KBD) {
+		kbd_intr();
+		sched_wake_irq(IRQ_KBD);
+		return;
+	}
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_SERIAL) {
+		serial_intr();
+		sched_wake_irq(IRQ_SERIAL);
+		return;
+	}
 
 	// Handle spurious interupts
 	// The hardware sometimes raises these because of noise on the
@@ -182,17 +218,53 @@ trap_dispatch(struct Trapframe *tf)
 void
 trap(struct Trapframe *tf)
 {
-	if ((tf->tf_cs & 3) == 3) {
-		// Trapped from user mode.
-		// Copy trap frame (which is currently on the stack)
-		// into 'curenv->env_tf', so that running the environment
-		// will restart at the trap point.
-		assert(curenv);
-		curenv->env_tf = *tf;
-		// The trapframe on the stack should be ignored from here on.
-		tf = &curenv->env_tf;
+	bool locked;
+
+	if ((tf->tf_cs & 3) == 3)
+		thiscpu->cpu_in_user = 0;
+
+	// The CPU asking for a TLB shootdown holds the kernel lock and
+	// waits for us, so answer without it.
+	if (tf->tf_trapno == IRQ_OFFSET + IRQ_TLB) {
+		tlb_sync();
+		lapic_eoi();
+		if ((tf->tf_cs & 3) == 3) {
+			thiscpu->cpu_in_user = 1;
+			env_pop_tf(tf);
+		}
+		return;
 	}
-	
+
+	// A trap taken in kernel mode: a fault on user memory, under the
+	// kernel lock, or an interrupt waking up sched_halt(), which let
+	// the lock go.  Resume the interrupted kernel code once handled
+	// (see _alltraps).
+	if ((tf->tf_cs & 3) == 0) {
+		if ( (locked = !spin_holding(&kernel_lock)))
+			lock_kernel();
+		trap_dispatch(tf);
+		if (locked)
+			unlock_kernel();
+		return;
+	}
+
+	// Trapped from user mode.
+	lock_kernel();
+	tlb_sync();
+
+	// Copy trap frame (which is currently on the stack)
+	// into 'curenv->env_tf', so that running the environment
+	// will restart at the trap point.
+	assert(curenv);
+	env_charge(1);
+	curenv->env_tf = *tf;
+	// The trapframe on the stack should be ignored from here on.
+	tf = &curenv->env_tf;
+
+	// another CPU destroyed curenv meanwhile
+	if (curenv->env_dying)
+		env_destroy(curenv);
+
 	// Dispatch based on what type of trap occurred
 	trap_dispatch(tf);
 
@@ -215,15 +287,32 @@ void
 page_fault_handler(struct Trapframe *tf)
 {
 	uint32_t fault_va;
-	struct UTrapframe *utf;
+	uintptr_t fixup;
+	struct UTrapframe *utf, frame;
 
 	// Read processor's CR2 register to find the faulting address
 	fault_va = rcr2();
 
+	// Write faults on copy-on-write pages are resolved right here,
+	// whether the user or the kernel, on its behalf, wrote the page.
+	if (curenv && (tf->tf_err & FEC_WR) &&
+		page_cow_fault(curenv->env_pgdir, (void *) fault_va) == 0)
+		return;
+
+	// So are first touches of demand-zero memory.
+	if (curenv && !(tf->tf_err & FEC_PR) &&
+		vma_fault(curenv, fault_va) == 0)
+		return;
+
 	// Handle kernel-mode page faults.	
-	// If we are in kernel mode, and dereferencing a kernel data struct,
-	// then fault, we met a problem.
-	if ( (tf->tf_cs & 3) == 0 && fault_va >= KERNBASE)
+	// Copies from and to user memory fail gracefully (kern/uaccess.h).
+	// Otherwise, if we are in kernel mode, and dereferencing a kernel
+	// data struct, then fault, we met a problem.
+	if ( (tf->tf_cs & 3) == 0 && (fixup = extable_fixup(tf->tf_eip))) {
+		tf->tf_eip = fixup;
+		return;
+	}
+	if ( (tf->tf_cs & 3) == 0)
 		panic("Page fault in Kernel mode, ip: %08x, "
 			"fault va: %08x\n", tf->tf_eip, fault_va);
 
@@ -268,13 +357,17 @@ page_fault_handler(struct Trapframe *tf)
 
 	// push a userspace trap-frame
 	utf --;
-	user_mem_assert(curenv, (void *)utf, sizeof(*utf), 0);
-	utf->utf_fault_va = fault_va;
-	utf->utf_err = tf->tf_err;
-	utf->utf_regs = tf->tf_regs;
-	utf->utf_eip = tf->tf_eip;
-	utf->utf_eflags = tf->tf_eflags;
-	utf->utf_esp = tf->tf_esp;
+	frame.utf_fault_va = fault_va;
+	frame.utf_err = tf->tf_err;
+	frame.utf_regs = tf->tf_regs;
+	frame.utf_eip = tf->tf_eip;
+	frame.utf_eflags = tf->tf_eflags;
+	frame.utf_esp = tf->tf_esp;
+	if (copy_to_user(utf, &frame, sizeof(frame)) < 0) {
+		cprintf("[%08x] no exception stack at va %08x\n",
+			curenv->env_id, utf);
+		goto no_handler;
+	}
 
 	curenv->env_tf.tf_eip = (uintptr_t)curenv->env_pgfault_upcall;
 	curenv->env_tf.tf_esp = (uintptr_t)utf;
@@ -0,0 +1,56 @@
+/* See COPYRIGHT for copyright information. */
+
+#include <inc/memlayout.h>
+#include <inc/error.h>
+
+#include <kern/uaccess.h>
+
+extern const struct Extable __EX_TABLE_BEGIN__[];
+extern const struct Extable __EX_TABLE_END__[];
+
+int __copy_user(void *dst, const void *src, size_t len);
+
+//
+// Copy 'len' bytes from user address 'usrc' to kernel buffer 'dst'.
+// Returns -E_FAULT if part of the user buffer is not readable by the
+// user.
+//
+int
+copy_from_user(void *dst, const void *usrc, size_t len)
+{
+	if ((uintptr_t) usrc >= ULIM || len > ULIM - (uintptr_t) usrc)
+		return -E_FAULT;
+	if (__copy_user(dst, usrc, len) < 0)
+		return -E_FAULT;
+	return 0;
+}
+
+//
+// Copy 'len' bytes from kernel buffer 'src' to user address 'udst'.
+// Returns -E_FAULT if part of the user buffer is not writable by the
+// user.
+//
+int
+copy_to_user(void *udst, const void *src, size_t len)
+{
+	if ((uintptr_t) udst >= UTOP || len > UTOP - (uintptr_t) udst)
+		return -E_FAULT;
+	if (__copy_user(udst, src, len) < 0)
+		return -E_FAULT;
+	return 0;
+}
+
+//
+// Returns where to resume a kernel-mode fault at 'eip', 0 if the fault
+// was not expected.
+//
+uintptr_t
+extable_fixup(uintptr_t eip)
+{
+	const struct Extable *ex;
+
+	for (ex = __EX_TABLE_BEGIN__; ex < __EX_TABLE_END__; ex++)
+		if (ex->ex_insn == eip)
+			return ex->ex_fixup;
+	return 0;
+}
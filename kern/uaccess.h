@@ -0,0 +1,30 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_UACCESS_H
+#define JOS_KERN_UACCESS_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+// Copying from and to user memory.
+//
+// Rather than walking the page tables first (user_mem_check()), these
+// check the bounds of the user buffer and just copy.  An instruction
+// that may fault on a user address has an entry in the exception table
+// (section .ex_table, see kern/usercopy.S): page_fault_handler() resumes
+// a kernel-mode fault at such an instruction at its fixup address, and
+// the copy fails with -E_FAULT.  Copy-on-write and demand-zero pages
+// are resolved by the fault handler before that, as for the user.
+
+struct Extable {
+	uintptr_t ex_insn;	// instruction allowed to fault
+	uintptr_t ex_fixup;	// where to resume if it does
+};
+
+int	copy_from_user(void *dst, const void *usrc, size_t len);
+int	copy_to_user(void *udst, const void *src, size_t len);
+uintptr_t extable_fixup(uintptr_t eip);
+
+#endif	// !JOS_KERN_UACCESS_H
@@ -0,0 +1,297 @@
+/* See COPYRIGHT for copyright information. */
+
+#include <inc/mmu.h>
+#include <inc/error.h>
+#include <inc/string.h>
+#include <inc/assert.h>
+
+#include <kern/pmap.h>
+#include <kern/buddy.h>
+#include <kern/env.h>
+#include <kern/vma.h>
+
+#define KDEBUG
+#include <kern/kdebug.h>
+
+static const char * const vma_backing_name[] = {
+	[VMA_PAGES]	"pages",
+	[VMA_ZERO]	"zero",
+};
+
+//
+// Index of the first area of 'e' ending above 'va', env_nvmas if none.
+//
+static int
+vma_index(struct Env *e, uintptr_t va)
+{
+	int lo = 0, hi = e->env_nvmas, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (e->env_vmas[mid].vm_end > va)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo;
+}
+
+//
+// Make sure env_vmas has room for 'n' more areas, moving them to a
+// larger block if it is too small.
+// Returns -E_NO_MEM if out of memory.
+//
+int
+vma_reserve(struct Env *e, int n)
+{
+	struct Page *pp;
+	struct Vma *v;
+	int order = 0;
+
+	if (e->env_vmas) {
+		if (e->env_nvmas + n <= VMA_MAX(e))
+			return 0;
+		order = e->env_vmas_order;
+	}
+	while ((PGSIZE << order) / sizeof(struct Vma) < e->env_nvmas + n)
+		order++;
+
+	if (order > MAX_ORDER || pages_alloc(&pp, order) < 0)
+		return -E_NO_MEM;
+	v = page2kva(pp);
+	if (e->env_vmas) {
+		memmove(v, e->env_vmas, e->env_nvmas * sizeof(struct Vma));
+		pages_free(kva2page((uintptr_t) e->env_vmas),
+			   e->env_vmas_order);
+	}
+	e->env_vmas = v;
+	e->env_vmas_order = order;
+	return 0;
+}
+
+//
+// Make room for one more area at index 'i'.
+//
+static int
+vma_grow(struct Env *e, int i)
+{
+	int r;
+
+	if ( (r = vma_reserve(e, 1)) < 0)
+		return r;
+	memmove(&e->env_vmas[i + 1], &e->env_vmas[i],
+		(e->env_nvmas - i) * sizeof(struct Vma));
+	e->env_nvmas++;
+	return 0;
+}
+
+//
+// Merge areas 'i' - 1 and 'i' if they are adjacent and alike.
+//
+static void
+vma_join(struct Env *e, int i)
+{
+	struct Vma *v = e->env_vmas;
+
+	if (i <= 0 || i >= e->env_nvmas || v[i - 1].vm_end != v[i].vm_start ||
+		v[i - 1].vm_perm != v[i].vm_perm ||
+		v[i - 1].vm_backing != v[i].vm_backing)
+		return;
+
+	v[i - 1].vm_end = v[i].vm_end;
+	memmove(&v[i], &v[i + 1], (e->env_nvmas - i - 1) * sizeof(*v));
+	e->env_nvmas--;
+}
+
+//
+// Make sure no area of 'e' straddles 'va'.
+//
+static int
+vma_split(struct Env *e, uintptr_t va)
+{
+	int i = vma_index(e, va), r;
+
+	if (i == e->env_nvmas || e->env_vmas[i].vm_start >= va)
+		return 0;
+	if ( (r = vma_grow(e, i)) < 0)
+		return r;
+	e->env_vmas[i].vm_end = va;
+	e->env_vmas[i + 1].vm_start = va;
+	return 0;
+}
+
+//
+// Returns the area of 'e' holding 'va', NULL if none.
+//
+struct Vma *
+vma_lookup(struct Env *e, uintptr_t va)
+{
+	int i = vma_index(e, va);
+
+	if (i < e->env_nvmas && e->env_vmas[i].vm_start <= va)
+		return &e->env_vmas[i];
+	return NULL;
+}
+
+//
+// Record [start, end) of 'e' as an area with 'perm' and 'backing',
+// replacing whatever was recorded there.
+// Returns -E_NO_MEM if out of memory.
+//
+int
+vma_map(struct Env *e, uintptr_t start, uintptr_t end, int perm,
+	int backing)
+{
+	int i, r;
+
+	assert(PGOFF(start) == 0 && PGOFF(end) == 0 && start < end);
+	if ( (r = vma_unmap(e, start, end)) < 0)
+		return r;
+
+	i = vma_index(e, start);
+	if ( (r = vma_grow(e, i)) < 0)
+		return r;
+	e->env_vmas[i].vm_start = start;
+	e->env_vmas[i].vm_end = end;
+	e->env_vmas[i].vm_perm = perm;
+	e->env_vmas[i].vm_backing = backing;
+
+	vma_join(e, i + 1);
+	vma_join(e, i);
+	return 0;
+}
+
+//
+// Forget whatever is recorded in [start, end) of 'e'.
+// Returns -E_NO_MEM if an area would have to be split and there is no
+// memory to grow env_vmas.
+//
+int
+vma_unmap(struct Env *e, uintptr_t start, uintptr_t end)
+{
+	int i, j, r;
+
+	if ( (r = vma_split(e, start)) < 0 || (r = vma_split(e, end)) < 0)
+		return r;
+
+	i = vma_index(e, start);
+	j = vma_index(e, end);
+	memmove(&e->env_vmas[i], &e->env_vmas[j],
+		(e->env_nvmas - j) * sizeof(struct Vma));
+	e->env_nvmas -= j - i;
+	return 0;
+}
+
+//
+// Change the permissions of the areas recorded in [start, end) of 'e'.
+// Returns -E_NO_MEM if an area would have to be split and there is no
+// memory to grow env_vmas.
+//
+int
+vma_protect(struct Env *e, uintptr_t start, uintptr_t end, int perm)
+{
+	int i, j, k, r;
+
+	if ( (r = vma_split(e, start)) < 0 || (r = vma_split(e, end)) < 0)
+		return r;
+
+	i = vma_index(e, start);
+	j = vma_index(e, end);
+	for (k = i; k < j; k++)
+		e->env_vmas[k].vm_perm = perm;
+
+	// merge from the end, so the indices below stay valid
+	for (k = j; k >= i; k--)
+		vma_join(e, k);
+	return 0;
+}
+
+//
+// Map a zeroed page at 'va' of 'e', if it falls in a demand-zero area
+// and nothing is mapped there yet.
+//
+// RETURNS 
+//   0 -- on success, the faulting access should be retried
+//   -E_INVAL -- if 'va' is not a demand-zero page
+//   -E_NO_MEM -- if out of memory
+//
+int
+vma_fault(struct Env *e, uintptr_t va)
+{
+	struct Vma *v;
+	struct Page *pp;
+	int r;
+
+	va = ROUNDDOWN(va, PGSIZE);
+	if (!(v = vma_lookup(e, va)) || v->vm_backing != VMA_ZERO ||
+		page_lookup(e->env_pgdir, (void *) va, NULL))
+		return -E_INVAL;
+
+	// same policy as sys_page_alloc_zeroed()
+	if (page_coloring)
+		r = page_alloc_color(&pp, PPN(va) + ENVX(e->env_id));
+	else
+		r = page_alloc_zeroed(&pp);
+	if (r < 0)
+		return r;
+	if (page_coloring)
+		memset(page2kva(pp), 0, PGSIZE);
+
+	if ( (r = page_insert(e->env_pgdir, pp, (void *) va, v->vm_perm)) < 0) {
+		page_free(pp);
+		return r;
+	}
+	return 0;
+}
+
+//
+// Give 'dst' a copy of the areas of 'src'.
+// Returns -E_NO_MEM if out of memory.
+//
+int
+vma_fork(struct Env *dst, struct Env *src)
+{
+	struct Page *pp;
+
+	assert(dst->env_vmas == NULL);
+	if (!src->env_nvmas)
+		return 0;
+
+	if (pages_alloc(&pp, src->env_vmas_order) < 0)
+		return -E_NO_MEM;
+	dst->env_vmas = page2kva(pp);
+	dst->env_vmas_order = src->env_vmas_order;
+	memmove(dst->env_vmas, src->env_vmas,
+		src->env_nvmas * sizeof(struct Vma));
+	dst->env_nvmas = src->env_nvmas;
+	return 0;
+}
+
+void
+vma_free(struct Env *e)
+{
+	if (e->env_vmas)
+		pages_free(kva2page((uintptr_t) e->env_vmas),
+			   e->env_vmas_order);
+	e->env_vmas = NULL;
+	e->env_nvmas = 0;
+	e->env_vmas_order = 0;
+}
+
+void
+vma_info(struct Env *e)
+{
+	struct Vma *v;
+	char perm[4];
+
+	cprintf("[%08x] %d areas\n", e->env_id, e->env_nvmas);
+	for (v = e->env_vmas; v < e->env_vmas + e->env_nvmas; v++) {
+		perm[0] = 'r';
+		perm[1] = (v->vm_perm & PTE_W) ? 'w' : '-';
+		perm[2] = (v->vm_perm & PTE_SHARE) ? 's' : '-';
+		perm[3] = 0;
+		cprintf("  %08x-%08x %s %-5s %6dK\n", v->vm_start, v->vm_end,
+			perm, vma_backing_name[v->vm_backing],
+			(v->vm_end - v->vm_start) / 1024);
+	}
+}
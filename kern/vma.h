@@ -0,0 +1,58 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_VMA_H
+#define JOS_KERN_VMA_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+#include <inc/mmu.h>
+#include <inc/env.h>
+
+// Virtual memory areas: the layout of an environment's address space.
+//
+// Every range the system calls map, reserve, reprotect or unmap is
+// recorded in env_vmas, an array of non-overlapping areas sorted by
+// address, so an address is looked up by binary search.  The array
+// starts out as one page and doubles whenever it fills up.  Adjacent
+// areas with the same permissions and backing are merged.
+//
+// An area describes what may be mapped there: pages of a VMA_PAGES
+// area are mapped by the system calls that record it, and those of a
+// VMA_ZERO area are only mapped on first touch, by page_fault_handler().
+//
+// vma_map(), vma_unmap() and vma_protect() add at most VMA_RESERVE
+// areas, so they cannot fail after vma_reserve(e, VMA_RESERVE).  The
+// system calls reserve that room first, and change the page tables
+// only once the areas can no longer fail to be recorded.
+
+// Values of vm_backing
+#define VMA_PAGES	0	// pages mapped explicitly
+#define VMA_ZERO	1	// demand-zero, filled in by the kernel
+
+struct Vma {
+	uintptr_t vm_start;		// first byte of the area
+	uintptr_t vm_end;		// one past its last byte
+	int vm_perm;			// permissions of its pages
+	int vm_backing;			// VMA_PAGES or VMA_ZERO
+};
+
+// Number of areas env_vmas has room for
+#define VMA_MAX(e)	((PGSIZE << (e)->env_vmas_order) / sizeof(struct Vma))
+
+// Room vma_map(), vma_unmap() and vma_protect() may need
+#define VMA_RESERVE	2
+
+struct Vma *vma_lookup(struct Env *e, uintptr_t va);
+int	vma_reserve(struct Env *e, int n);
+int	vma_map(struct Env *e, uintptr_t start, uintptr_t end, int perm,
+		int backing);
+int	vma_unmap(struct Env *e, uintptr_t start, uintptr_t end);
+int	vma_protect(struct Env *e, uintptr_t start, uintptr_t end, int perm);
+int	vma_fault(struct Env *e, uintptr_t va);
+int	vma_fork(struct Env *dst, struct Env *src);
+void	vma_free(struct Env *e);
+void	vma_info(struct Env *e);
+
+#endif	// !JOS_KERN_VMA_H
@@ -15,7 +15,12 @@ cputchar(int ch)
 int
 getchar(void)
 {
-	return sys_cgetc();
+	int c;
+
+	// sys_cgetc() returns 0 after sleeping until input arrives
+	while ((c = sys_cgetc()) == 0)
+		/* do nothing */;
+	return c;
 }
 
 
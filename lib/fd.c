@@ -196,8 +196,7 @@ dup(int oldfdnum, int newfdnum)
 
 err:
 	sys_page_unmap(0, newfd);
-	for (i = 0; i < PTSIZE; i += PGSIZE)
-		sys_page_unmap(0, nva + i);
+	sys_page_unmap_range(0, nva, PTSIZE);
 	return r;
 }
 
@@ -3,9 +3,35 @@
 #include <inc/string.h>
 #include <inc/lib.h>
 
-// PTE_COW marks copy-on-write page table entries.
-// It is one of the bits explicitly allocated to user processes (PTE_AVAIL).
-#define PTE_COW		0x800
+// Pages duplicated per pair of sys_page_map_batch() calls.  The batch
+// lives on the stack, which is copied separately rather than shared,
+// so keep it well below a page.
+#define DUP_BATCH	64
+
+//
+// Give us a private writable copy of the copy-on-write superpage
+// holding 'addr', copied as a whole through UTEMP.
+//
+static void
+superpage_fault(void *addr)
+{
+	int perm, r;
+
+	perm = vpd[VPD(addr)] & PTE_USER;
+	if (!(perm & PTE_COW))
+		panic("write access to non copy-on-write superpage\n");
+	perm = (perm & ~PTE_COW) | PTE_W;
+
+	addr = ROUNDDOWN(addr, PTSIZE);
+	if ( (r = sys_page_alloc_large(0, UTEMP, PTE_U|PTE_P|PTE_W)) < 0)
+		panic("sys_page_alloc_large: %e\n", r);
+	memmove(UTEMP, addr, PTSIZE);
+
+	if ( (r = sys_page_map(0, UTEMP, 0, addr, perm)) < 0)
+		panic("sys_page_map: %e", r);
+	if ( (r = sys_page_unmap(0, UTEMP)) < 0)
+		panic("sys_page_unmap: %e", r);
+}
 
 //
 // Custom page fault handler - if faulting page is copy-on-write,
@@ -25,6 +51,10 @@ pgfault(struct UTrapframe *utf)
 	//   Use the read-only page table mappings at vpt
 	//   (see <inc/memlayout.h>).
 	assert(vpd[VPD(addr)] != 0x0);
+	if (vpd[VPD(addr)] & PTE_PS) {
+		superpage_fault(addr);
+		return;
+	}
 	pte = vpt[VPN(addr)];
 
 	if ( !(pte & PTE_COW))
@@ -56,19 +86,16 @@ pgfault(struct UTrapframe *utf)
 }
 
 //
-// Map our virtual page pn (address pn*PGSIZE) into the target envid
-// at the same virtual address.  If the page is writable or copy-on-write,
-// the new mapping must be created copy-on-write, and then our mapping must be
-// marked copy-on-write as well.  (Exercise: Why mark ours copy-on-write again
+// Queue our virtual page pn (address pn*PGSIZE) in 'pm', to be mapped
+// into the target envid at the same virtual address by dupflush().
+// If the page is writable or copy-on-write, the new mapping must be
+// created copy-on-write, and then our mapping must be marked
+// copy-on-write as well.  (Exercise: Why mark ours copy-on-write again
 // if it was already copy-on-write?)
-//
-// Returns: 0 on success, < 0 on error.
-// It is also OK to panic on error.
 // 
-static int
-duppage(envid_t envid, unsigned pn)
+static void
+duppage(struct Page_map *pm, unsigned pn)
 {
-	int r;
 	void *addr;
 	pte_t pte;
 
@@ -84,16 +111,75 @@ duppage(envid_t envid, unsigned pn)
 		pte = (pte & ~PTE_W) | PTE_COW;
 	}
 
-	if ( (r = sys_page_map(0, (void *)addr, envid, 
-		(void *)addr, pte)) < 0)
-		panic("child: sys_page_map: %e", r);
+	pm->pm_srcva = addr;
+	pm->pm_dstva = addr;
+	pm->pm_perm = pte;
+}
+
+//
+// Map the 'n' pages queued by duppage() into the target envid, then
+// fix our own page table entries, with one system call each.
+// Panics on error.
+//
+static void
+dupflush(envid_t envid, struct Page_map *maps, int n)
+{
+	int i, r;
+
+	if (!n)
+		return;
 
-	// also, fix our page table entry
-	if ( (r = sys_page_map(0, (void *)addr, 0, 
-		(void *)addr, pte)) < 0)
-		panic("parent: sys_page_map: %e", r);
+	if ( (r = sys_page_map_batch(0, envid, maps, n)) < 0)
+		panic("child: sys_page_map_batch: %e", r);
+	for (i = 0; r && i < n; i++)
+		if (maps[i].pm_status < 0)
+			panic("child: map %08x: %e", maps[i].pm_srcva,
+			      maps[i].pm_status);
 
-	return 0;
+	// also, fix our page table entries
+	if ( (r = sys_page_map_batch(0, 0, maps, n)) < 0)
+		panic("parent: sys_page_map_batch: %e", r);
+	for (i = 0; r && i < n; i++)
+		if (maps[i].pm_status < 0)
+			panic("parent: map %08x: %e", maps[i].pm_srcva,
+			      maps[i].pm_status);
+}
+
+//
+// Map our superpage at 'addr' into the target envid at the same
+// address, copy-on-write on both sides unless it is shared.
+// Panics on error.
+//
+static void
+dupsuperpage(envid_t envid, void *addr)
+{
+	int perm, r;
+
+	perm = vpd[PDX(addr)] & PTE_USER;
+	if (!(perm & PTE_SHARE) && (perm & (PTE_W|PTE_COW)))
+		perm = (perm & ~PTE_W) | PTE_COW;
+
+	if ( (r = sys_page_map(0, addr, envid, addr, perm)) < 0)
+		panic("superpage: sys_page_map: %e", r);
+	if ( (r = sys_page_map(0, addr, 0, addr, perm)) < 0)
+		panic("superpage: sys_page_map: %e", r);
+}
+
+//
+// Fork with copy-on-write, done by the kernel in one system call.
+// Write faults on copy-on-write pages are resolved by the kernel too,
+// without a page fault upcall.
+//
+// Returns: child's envid to the parent, 0 to the child, < 0 on error.
+//
+envid_t
+fork(void)
+{
+	envid_t child;
+
+	if ( (child = sys_fork()) == 0)
+		env = &envs[ENVX(sys_getenvid())];
+	return child;
 }
 
 //
@@ -113,11 +199,13 @@ duppage(envid_t envid, unsigned pn)
 //   so you must allocate a new page for the child's user exception stack.
 //
 envid_t
-fork(void)
+ufork(void)
 {
 	envid_t child;
 	extern unsigned char end[];
 	uint8_t *addr;
+	struct Page_map maps[DUP_BATCH];
+	int n = 0;
 	int r;
 
 	extern void _pgfault_upcall(void);
@@ -144,9 +232,22 @@ fork(void)
 		return 0;
 	}
 
-	// We are parent, dup our address space to child's using COW
-	for (addr = (uint8_t *)UTEXT; addr < end; addr += PGSIZE)
-		duppage(child, PPN(addr));
+	// We are parent, dup our address space to child's using COW.
+	// Superpages are copy-on-write as a whole, like pages are.
+	for (addr = (uint8_t *)UTEXT; addr < end; addr += PGSIZE) {
+		if (vpd[PDX(addr)] & PTE_PS) {
+			addr = ROUNDDOWN(addr, PTSIZE);
+			dupsuperpage(child, addr);
+			addr += PTSIZE - PGSIZE;
+			continue;
+		}
+		duppage(&maps[n++], PPN(addr));
+		if (n == DUP_BATCH) {
+			dupflush(child, maps, n);
+			n = 0;
+		}
+	}
+	dupflush(child, maps, n);
 
 	// Share user stack by two environment is nonsense,
 	// a page fault will occur immediately when the child
@@ -7,6 +7,9 @@ pageref(void *v)
 
 	if (!(vpd[PDX(v)] & PTE_P))
 		return 0;
+	// superpages are reference counted on their first page
+	if (vpd[PDX(v)] & PTE_PS)
+		return pages[PPN(vpd[PDX(v)])].pp_ref;
 	pte = vpt[VPN(v)];
 	if (!(pte & PTE_P))
 		return 0;
@@ -174,9 +174,12 @@ map_segment(envid_t child, uintptr_t va, size_t memsz,
 
 	for (i = 0; i < memsz; i += PGSIZE) {
 		if (i >= filesz) {
-			// allocate a blank page
-			if ((r = sys_page_alloc(child, (void*) (va + i), perm)) < 0)
+			// the rest is blank, let the kernel fill it in
+			// on first touch
+			if ((r = sys_page_reserve(child, (void*) (va + i),
+				ROUNDUP(memsz, PGSIZE) - i, perm)) < 0)
 				return r;
+			break;
 		} else {
 			// from file
 			if (perm & PTE_W) {
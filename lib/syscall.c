@@ -61,6 +61,12 @@ sys_getenvid(void)
 	 return syscall(SYS_getenvid, 0, 0, 0, 0, 0, 0);
 }
 
+int
+sys_env_cputime(struct Env_cputime *ct)
+{
+	return syscall(SYS_env_cputime, 1, (uint32_t) ct, 0, 0, 0, 0);
+}
+
 void
 sys_yield(void)
 {
@@ -73,18 +79,60 @@ sys_page_alloc(envid_t envid, void *va, int perm)
 	return syscall(SYS_page_alloc, 1, envid, (uint32_t) va, perm, 0, 0);
 }
 
+int
+sys_page_alloc_zeroed(envid_t envid, void *va, int perm)
+{
+	return syscall(SYS_page_alloc_zeroed, 1, envid, (uint32_t) va, perm, 0, 0);
+}
+
+int
+sys_page_alloc_large(envid_t envid, void *va, int perm)
+{
+	return syscall(SYS_page_alloc_large, 1, envid, (uint32_t) va, perm, 0, 0);
+}
+
 int
 sys_page_map(envid_t srcenv, void *srcva, envid_t dstenv, void *dstva, int perm)
 {
 	return syscall(SYS_page_map, 1, srcenv, (uint32_t) srcva, dstenv, (uint32_t) dstva, perm);
 }
 
+int
+sys_page_map_batch(envid_t srcenv, envid_t dstenv, struct Page_map *maps, unsigned n)
+{
+	return syscall(SYS_page_map_batch, 0, srcenv, dstenv, (uint32_t) maps, n, 0);
+}
+
+envid_t
+sys_fork(void)
+{
+	return syscall(SYS_fork, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_page_reserve(envid_t envid, void *va, size_t len, int perm)
+{
+	return syscall(SYS_page_reserve, 1, envid, (uint32_t) va, len, perm, 0);
+}
+
 int
 sys_page_unmap(envid_t envid, void *va)
 {
 	return syscall(SYS_page_unmap, 1, envid, (uint32_t) va, 0, 0, 0);
 }
 
+int
+sys_page_unmap_range(envid_t envid, void *va, size_t len)
+{
+	return syscall(SYS_page_unmap_range, 1, envid, (uint32_t) va, len, 0, 0);
+}
+
+int
+sys_page_protect_range(envid_t envid, void *va, size_t len, int perm)
+{
+	return syscall(SYS_page_protect_range, 1, envid, (uint32_t) va, len, perm, 0);
+}
+
 // sys_exofork is inlined in lib.h
 
 int
@@ -93,6 +141,12 @@ sys_env_set_status(envid_t envid, int status)
 	return syscall(SYS_env_set_status, 1, envid, status, 0, 0, 0);
 }
 
+int
+sys_env_set_priority(envid_t envid, int prio)
+{
+	return syscall(SYS_env_set_priority, 1, envid, prio, 0, 0, 0);
+}
+
 int
 sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
 {
@@ -1,20 +1,37 @@
 // Demonstrate lack of fairness in IPC.
 // Start three instances of this program as envs 1, 2, and 3.
 // (user/idle is env 0).
+//
+// The receiver reports how many of every REPORT messages came from each
+// sender; with a fair scheduler the shares come out about even.
 
 #include <inc/lib.h>
 
+#define REPORT	1000
+
+static unsigned nrecv[NENV];
+
 void
 umain(void)
 {
 	envid_t who, id;
+	unsigned n;
+	int i;
 
 	id = sys_getenvid();
 
 	if (env == &envs[1]) {
-		while (1) {
+		for (n = 1; ; n++) {
 			ipc_recv(&who, 0, 0);
-			cprintf("%x recv from %x\n", id, who);
+			nrecv[ENVX(who)]++;
+			if (n % REPORT)
+				continue;
+			for (i = 0; i < NENV; i++)
+				if (nrecv[i]) {
+					cprintf("%x recv %d from %x\n", id,
+						nrecv[i], envs[i].env_id);
+					nrecv[i] = 0;
+				}
 		}
 	} else {
 		cprintf("%x loop sending to %x\n", id, envs[1].env_id);
@@ -1,5 +1,7 @@
 // Test preemption by forking off a child process that just spins forever.
 // Let it run for a couple time slices, then kill it.
+// The child uses up every slice it gets, so by then the scheduler
+// should have demoted it below the parent, which keeps yielding.
 
 #include <inc/lib.h>
 
@@ -7,6 +9,7 @@ void
 umain(void)
 {
 	envid_t env;
+	volatile struct Env *child, *self;
 
 	cprintf("I am the parent.  Forking the child...\n");
 	if ((env = fork()) == 0) {
@@ -25,6 +28,13 @@ umain(void)
 	sys_yield();
 	sys_yield();
 
+	child = &envs[ENVX(env)];
+	self = &envs[ENVX(sys_getenvid())];
+	cprintf("The child ran %d times, at priority %d (parent %d).\n",
+		child->env_runs, child->env_prio, self->env_prio);
+	if (child->env_prio <= self->env_prio)
+		panic("spinning child was not demoted");
+
 	cprintf("I am the parent.  Killing the child...\n");
 	sys_env_destroy(env);
 }
@@ -0,0 +1,47 @@
+// test sys_env_cputime: user time grows while spinning, runs grow
+// across a yield, and bad pointers are refused
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define SPIN	10000000	// TSC cycles
+#define RDONLY	((char *) 0x10000000)
+
+void
+umain(void)
+{
+	struct Env_cputime ct0, ct1;
+	uint64_t start;
+	int r;
+
+	if ((r = sys_env_cputime(&ct0)) != 0)
+		panic("sys_env_cputime: %e", r);
+	if (ct0.ct_runs < 1 || ct0.ct_user == 0)
+		panic("no time charged yet: %d runs", ct0.ct_runs);
+
+	start = read_tsc();
+	while (read_tsc() - start < SPIN)
+		/* spin */;
+	if ((r = sys_env_cputime(&ct1)) != 0)
+		panic("sys_env_cputime: %e", r);
+	if (ct1.ct_user <= ct0.ct_user)
+		panic("user time did not grow while spinning");
+	if (ct1.ct_kern < ct0.ct_kern)
+		panic("kernel time went backwards");
+	cprintf("user time is good\n");
+
+	sys_yield();
+	if ((r = sys_env_cputime(&ct0)) != 0)
+		panic("sys_env_cputime: %e", r);
+	if (ct0.ct_runs <= ct1.ct_runs)
+		panic("runs did not grow across a yield");
+	cprintf("runs are good\n");
+
+	if ((r = sys_env_cputime((struct Env_cputime *) ULIM)) != -E_FAULT)
+		panic("kernel pointer: got %d, wanted -E_FAULT", r);
+	if ((r = sys_page_alloc(0, RDONLY, PTE_P|PTE_U)) < 0)
+		panic("sys_page_alloc: %e", r);
+	if ((r = sys_env_cputime((struct Env_cputime *) RDONLY)) != -E_FAULT)
+		panic("read-only pointer: got %d, wanted -E_FAULT", r);
+	cprintf("cputime errors are good\n");
+}
@@ -0,0 +1,53 @@
+// test sys_fork: pages are shared copy-on-write, and each side's
+// first write gives it a private copy
+
+#include <inc/lib.h>
+
+// A page of its own, so that nothing but the test writes to it.
+static volatile int data[PGSIZE / sizeof(int)]
+	__attribute__((aligned(PGSIZE))) = { 1 };
+
+// Whether a write to 'va' would go through without a fault.
+static bool
+writable(volatile void *va)
+{
+	return (vpd[VPD(va)] & PTE_W) && (vpt[VPN(va)] & PTE_W);
+}
+
+void
+umain(void)
+{
+	envid_t child, who;
+	int r;
+
+	if (!writable(data))
+		panic("data is not writable before the fork");
+
+	if ((child = sys_fork()) < 0)
+		panic("sys_fork: %e", child);
+	if (child == 0) {
+		env = &envs[ENVX(sys_getenvid())];
+		if (data[0] != 1)
+			panic("child sees %d, wanted 1", data[0]);
+		if (writable(data))
+			panic("child's page is not copy-on-write");
+		data[0] = 3;
+		if (!writable(data) || data[0] != 3)
+			panic("child's write did not stick");
+		ipc_send(env->env_parent_id, data[0], 0, 0);
+		return;
+	}
+
+	if (writable(data))
+		panic("parent's page is not copy-on-write");
+	data[0] = 2;
+	if (!writable(data) || data[0] != 2)
+		panic("parent's write did not stick");
+	cprintf("parent copy-on-write is good\n");
+
+	if ((r = ipc_recv(&who, 0, 0)) != 3 || who != child)
+		panic("child sent %d, wanted 3", r);
+	if (data[0] != 2)
+		panic("child's write reached the parent");
+	cprintf("child copy-on-write is good\n");
+}
@@ -0,0 +1,65 @@
+// test sys_page_map_batch: results per entry, and the mappings it makes
+
+#include <inc/lib.h>
+
+#define SRC	((char *) 0x10000000)
+#define DST	((char *) 0x20000000)
+#define NPAGES	4
+
+static struct Page_map maps[NPAGES + 1];
+
+void
+umain(void)
+{
+	int i, r;
+
+	for (i = 0; i < NPAGES; i++) {
+		if ((r = sys_page_alloc(0, SRC + i * PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+		SRC[i * PGSIZE] = 'a' + i;
+	}
+
+	// map them all at DST, the last one read-only, plus one entry
+	// whose source page is not mapped
+	for (i = 0; i < NPAGES; i++) {
+		maps[i].pm_srcva = SRC + i * PGSIZE;
+		maps[i].pm_dstva = DST + i * PGSIZE;
+		maps[i].pm_perm = PTE_P|PTE_U|PTE_W;
+		maps[i].pm_status = 1;
+	}
+	maps[NPAGES - 1].pm_perm = PTE_P|PTE_U;
+	maps[NPAGES].pm_srcva = SRC + NPAGES * PGSIZE;
+	maps[NPAGES].pm_dstva = DST + NPAGES * PGSIZE;
+	maps[NPAGES].pm_perm = PTE_P|PTE_U|PTE_W;
+	maps[NPAGES].pm_status = 1;
+
+	if ((r = sys_page_map_batch(0, 0, maps, NPAGES + 1)) != 1)
+		panic("sys_page_map_batch returned %d, wanted 1", r);
+	for (i = 0; i < NPAGES; i++)
+		if (maps[i].pm_status != 0)
+			panic("entry %d: status %e", i, maps[i].pm_status);
+	if (maps[NPAGES].pm_status != -E_INVAL)
+		panic("unmapped source: status %d, wanted -E_INVAL",
+		      maps[NPAGES].pm_status);
+	cprintf("batch results are good\n");
+
+	for (i = 0; i < NPAGES; i++) {
+		if (PTE_ADDR(vpt[VPN(DST + i * PGSIZE)]) !=
+		    PTE_ADDR(vpt[VPN(SRC + i * PGSIZE)]))
+			panic("page %d mapped to the wrong physical page", i);
+		if (DST[i * PGSIZE] != 'a' + i)
+			panic("page %d holds '%c'", i, DST[i * PGSIZE]);
+	}
+	if (!(vpt[VPN(DST)] & PTE_W) || (vpt[VPN(DST + (NPAGES - 1) * PGSIZE)] & PTE_W))
+		panic("batch mappings have the wrong permissions");
+	if ((vpd[VPD(DST + NPAGES * PGSIZE)] & PTE_P) &&
+	    (vpt[VPN(DST + NPAGES * PGSIZE)] & PTE_P))
+		panic("failed entry mapped a page");
+	cprintf("batch mappings are good\n");
+
+	if ((r = sys_page_map_batch(0, 0, maps, PAGE_MAP_MAX + 1)) != -E_INVAL)
+		panic("too many entries: got %d, wanted -E_INVAL", r);
+	if ((r = sys_page_map_batch(0, 0, (struct Page_map *) ULIM, 1)) != -E_FAULT)
+		panic("kernel array: got %d, wanted -E_FAULT", r);
+	cprintf("batch errors are good\n");
+}
@@ -0,0 +1,105 @@
+// test sys_page_unmap_range and sys_page_protect_range, on pages and
+// on a copy-on-write superpage
+
+#include <inc/lib.h>
+
+#define VA	((char *) 0x10000000)
+#define NPAGES	40		// past TLB_FLUSH_PAGES, so the whole TLB is flushed
+#define SUPER	((char *) 0x40000000)
+
+static bool
+mapped(void *va)
+{
+	return (vpd[VPD(va)] & PTE_P) && (vpt[VPN(va)] & PTE_P);
+}
+
+static void
+alloc(char *va, int npages)
+{
+	int i, r;
+
+	for (i = 0; i < npages; i++)
+		if ((r = sys_page_alloc(0, va + i * PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_alloc: %e", r);
+}
+
+static void
+test_pages(void)
+{
+	int i, r;
+
+	alloc(VA, NPAGES);
+	if ((r = sys_page_protect_range(0, VA, NPAGES * PGSIZE, PTE_P|PTE_U)) < 0)
+		panic("sys_page_protect_range: %e", r);
+	for (i = 0; i < NPAGES; i++)
+		if (!mapped(VA + i * PGSIZE) || (vpt[VPN(VA + i * PGSIZE)] & PTE_W))
+			panic("page %d is not read-only", i);
+	if ((r = sys_page_protect_range(0, VA, PGSIZE, PTE_P|PTE_U|PTE_W)) != -E_INVAL)
+		panic("write on a read-only page: got %d, wanted -E_INVAL", r);
+	cprintf("protect range is good\n");
+
+	// unmap the middle, leaving a page on each side
+	if ((r = sys_page_unmap_range(0, VA + PGSIZE, (NPAGES - 2) * PGSIZE)) < 0)
+		panic("sys_page_unmap_range: %e", r);
+	for (i = 1; i < NPAGES - 1; i++)
+		if (mapped(VA + i * PGSIZE))
+			panic("page %d is still mapped", i);
+	if (!mapped(VA) || !mapped(VA + (NPAGES - 1) * PGSIZE))
+		panic("unmap range went past its ends");
+	// unmapped pages are skipped
+	if ((r = sys_page_unmap_range(0, VA, NPAGES * PGSIZE)) < 0)
+		panic("sys_page_unmap_range: %e", r);
+	if (mapped(VA) || mapped(VA + (NPAGES - 1) * PGSIZE))
+		panic("unmap range left pages mapped");
+	if ((r = sys_page_unmap_range(0, VA + 1, PGSIZE)) != -E_INVAL)
+		panic("unaligned va: got %d, wanted -E_INVAL", r);
+	cprintf("unmap range is good\n");
+}
+
+static void
+test_superpage(void)
+{
+	envid_t child;
+	int r;
+
+	if ((r = sys_page_alloc_large(0, SUPER, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_alloc_large: %e", r);
+	SUPER[0] = 1;
+	if ((r = sys_page_protect_range(0, SUPER, PGSIZE, PTE_P|PTE_U)) != -E_INVAL)
+		panic("part of a superpage: got %d, wanted -E_INVAL", r);
+	if ((r = sys_page_unmap_range(0, SUPER, PGSIZE)) != -E_INVAL)
+		panic("part of a superpage: got %d, wanted -E_INVAL", r);
+
+	if ((child = sys_fork()) < 0)
+		panic("sys_fork: %e", child);
+	if (child == 0) {
+		env = &envs[ENVX(sys_getenvid())];
+		// asking for PTE_W keeps it copy-on-write
+		if ((r = sys_page_protect_range(0, SUPER, PTSIZE,
+						PTE_P|PTE_U|PTE_W)) < 0)
+			panic("protect copy-on-write superpage: %e", r);
+		if ((vpd[VPD(SUPER)] & (PTE_W|PTE_COW|PTE_PS)) != (PTE_COW|PTE_PS))
+			panic("superpage is no longer copy-on-write");
+		SUPER[0] = 2;
+		if (!(vpd[VPD(SUPER)] & PTE_W) || SUPER[0] != 2)
+			panic("superpage write did not stick");
+		ipc_send(env->env_parent_id, 0, 0, 0);
+		return;
+	}
+
+	ipc_recv(0, 0, 0);
+	if (SUPER[0] != 1)
+		panic("child's write reached the parent's superpage");
+	if ((r = sys_page_unmap_range(0, SUPER, PTSIZE)) < 0)
+		panic("sys_page_unmap_range: %e", r);
+	if (vpd[VPD(SUPER)] & PTE_P)
+		panic("superpage is still mapped");
+	cprintf("superpage ranges are good\n");
+}
+
+void
+umain(void)
+{
+	test_pages();
+	test_superpage();
+}
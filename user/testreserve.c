@@ -0,0 +1,62 @@
+// test sys_page_reserve: demand-zero pages show up on first touch,
+// with the reserved permissions
+
+#include <inc/lib.h>
+
+#define VA	((char *) 0x10000000)
+#define NPAGES	4
+
+static bool
+mapped(void *va)
+{
+	return (vpd[VPD(va)] & PTE_P) && (vpt[VPN(va)] & PTE_P);
+}
+
+void
+umain(void)
+{
+	int i, r;
+
+	if ((r = sys_page_reserve(0, VA, NPAGES * PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_reserve: %e", r);
+	for (i = 0; i < NPAGES; i++)
+		if (mapped(VA + i * PGSIZE))
+			panic("page %d mapped before it was touched", i);
+
+	// reading the second page maps it alone, zeroed and writable
+	if (VA[PGSIZE + 10] != 0)
+		panic("demand-zero page is not zero");
+	if (!mapped(VA + PGSIZE) || !(vpt[VPN(VA + PGSIZE)] & PTE_W))
+		panic("touched page is not mapped writable");
+	if (mapped(VA) || mapped(VA + 2 * PGSIZE))
+		panic("touching one page mapped its neighbours");
+	VA[PGSIZE + 10] = 'x';
+	for (i = 0; i < NPAGES; i++)
+		VA[i * PGSIZE] = 'a' + i;
+	for (i = 0; i < NPAGES; i++)
+		if (VA[i * PGSIZE] != 'a' + i)
+			panic("page %d does not hold its value", i);
+	if (VA[PGSIZE + 10] != 'x')
+		panic("page 1 does not hold its value");
+	cprintf("read-write reservation is good\n");
+
+	// a read-only reservation maps read-only pages
+	if ((r = sys_page_reserve(0, VA + NPAGES * PGSIZE, PGSIZE, PTE_P|PTE_U)) < 0)
+		panic("sys_page_reserve: %e", r);
+	if (VA[NPAGES * PGSIZE] != 0)
+		panic("read-only demand-zero page is not zero");
+	if (vpt[VPN(VA + NPAGES * PGSIZE)] & PTE_W)
+		panic("read-only reservation mapped a writable page");
+	cprintf("read-only reservation is good\n");
+
+	if ((r = sys_page_reserve(0, VA + 1, PGSIZE, PTE_P|PTE_U)) != -E_INVAL)
+		panic("unaligned va: got %d, wanted -E_INVAL", r);
+	if ((r = sys_page_reserve(0, VA, 0, PTE_P|PTE_U)) != -E_INVAL)
+		panic("zero length: got %d, wanted -E_INVAL", r);
+	if ((r = sys_page_reserve(0, (void *) (UTOP - PGSIZE), 2 * PGSIZE,
+				  PTE_P|PTE_U)) != -E_INVAL)
+		panic("range above UTOP: got %d, wanted -E_INVAL", r);
+	if ((r = sys_page_reserve(0, VA, PGSIZE, PTE_P)) != -E_INVAL)
+		panic("bad perm: got %d, wanted -E_INVAL", r);
+	cprintf("reservation errors are good\n");
+}
@@ -0,0 +1,102 @@
+// test the kernel's memory areas: reserving, reprotecting and unmapping
+// split and merge them, and the area array grows past its first page
+
+#include <inc/lib.h>
+
+#define VA	((char *) 0x10000000)
+#define MANY	((char *) 0x20000000)
+#define NMANY	300		// more areas than fit in one page
+
+static volatile void *faulted;
+
+static bool
+mapped(volatile void *va)
+{
+	return (vpd[VPD(va)] & PTE_P) && (vpt[VPN(va)] & PTE_P);
+}
+
+static void
+handler(struct UTrapframe *utf)
+{
+	void *addr = (void *) utf->utf_fault_va;
+	int r;
+
+	faulted = addr;
+	if ((r = sys_page_alloc(0, ROUNDDOWN(addr, PGSIZE), PTE_P|PTE_U|PTE_W)) < 0)
+		panic("allocating at %x in page fault handler: %e", addr, r);
+}
+
+static void
+check_nvmas(int n, const char *what)
+{
+	if (env->env_nvmas != n)
+		panic("%s: %d areas, wanted %d", what, env->env_nvmas, n);
+}
+
+void
+umain(void)
+{
+	int i, n, r;
+
+	set_pgfault_handler(handler);
+	n = env->env_nvmas;
+
+	// adjacent reservations with the same permissions merge
+	if ((r = sys_page_reserve(0, VA, 3 * PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_reserve: %e", r);
+	check_nvmas(n + 1, "reserve");
+	if ((r = sys_page_reserve(0, VA + 3 * PGSIZE, PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_reserve: %e", r);
+	check_nvmas(n + 1, "adjacent reserve");
+
+	// reprotecting the middle splits the area, and undoing it merges it
+	if ((r = sys_page_protect_range(0, VA + PGSIZE, PGSIZE, PTE_P|PTE_U)) < 0)
+		panic("sys_page_protect_range: %e", r);
+	check_nvmas(n + 3, "protect middle");
+	if ((r = sys_page_protect_range(0, VA + PGSIZE, PGSIZE, PTE_P|PTE_U|PTE_W)) < 0)
+		panic("sys_page_protect_range: %e", r);
+	check_nvmas(n + 1, "protect middle back");
+
+	// a read-only piece maps read-only pages
+	if ((r = sys_page_protect_range(0, VA + 2 * PGSIZE, PGSIZE, PTE_P|PTE_U)) < 0)
+		panic("sys_page_protect_range: %e", r);
+	check_nvmas(n + 3, "protect");
+	if (VA[2 * PGSIZE] != 0 || !mapped(VA + 2 * PGSIZE) ||
+	    (vpt[VPN(VA + 2 * PGSIZE)] & PTE_W))
+		panic("read-only piece is not mapped read-only");
+	cprintf("split and merge on protect is good\n");
+
+	// unmapping the second page leaves a hole that faults
+	if ((r = sys_page_unmap_range(0, VA + PGSIZE, PGSIZE)) < 0)
+		panic("sys_page_unmap_range: %e", r);
+	check_nvmas(n + 3, "unmap");
+	VA[0] = 1;
+	VA[3 * PGSIZE] = 1;
+	if (faulted)
+		panic("fault at %x, inside a reserved area", faulted);
+	VA[PGSIZE] = 1;
+	if (faulted != VA + PGSIZE)
+		panic("touching the hole did not fault");
+	cprintf("split on unmap is good\n");
+
+	if ((r = sys_page_unmap_range(0, VA, 4 * PGSIZE)) < 0)
+		panic("sys_page_unmap_range: %e", r);
+	check_nvmas(n, "unmap all");
+
+	// every other page, so that none of them merge
+	for (i = 0; i < NMANY; i++)
+		if ((r = sys_page_reserve(0, MANY + 2 * i * PGSIZE, PGSIZE,
+					  PTE_P|PTE_U|PTE_W)) < 0)
+			panic("sys_page_reserve %d: %e", i, r);
+	check_nvmas(n + NMANY, "many reserves");
+	if (env->env_vmas_order == 0)
+		panic("area array did not grow");
+	for (i = 0; i < NMANY; i++)
+		MANY[2 * i * PGSIZE] = 1;
+	if (faulted != VA + PGSIZE)
+		panic("fault at %x, inside a reserved area", faulted);
+	if ((r = sys_page_unmap_range(0, MANY, 2 * NMANY * PGSIZE)) < 0)
+		panic("sys_page_unmap_range: %e", r);
+	check_nvmas(n, "unmap many");
+	cprintf("area array growth is good\n");
+}